@@ -5,31 +5,275 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <cpuid.h>
+#include <pthread.h>
 
 #define CLK_MOVING_AVERAGE_WINDOW 10
 #define RING_BUFFER_SIZE 2000
 
+// Serialization around the timed write, selected with the optional fourth argument.
+// cpuid traps to the hypervisor on virtualized hosts, the fence variants do not.
+#define SERIALIZE_CPUID 0
+#define SERIALIZE_LFENCE 1
+#define SERIALIZE_MFENCE_LFENCE 2
+#define SERIALIZE_INSTR 3 // only if CPUID.(EAX=7,ECX=0):EDX[14] is set
 
+// Timer of the kernels. If rdtscp traps (back-to-back reads take longer than TSC_TRAP_CYCLES) or the TSC is 
+// coarse (its step is above TSC_MAX_RESOLUTION), a counting thread on the SMT sibling replaces it. The output
+// files always contain TSC timestamps, the timebase that all demo processes share.
+#define TIMER_TSC 0
+#define TIMER_COUNTING_THREAD 1
+#define TIMER_PROBE_SAMPLES 1001
+#define TSC_TRAP_CYCLES 500
+#define TSC_MAX_RESOLUTION 16
+#define TIMER_SCALE_NS 50000000 // Duration of the comparison of both timers
+
+#ifdef HAS_RDTSCP
+#define TIMESTAMP_TSC_ASM "rdtscp\n\tshl $32, %%rdx\n\tor %%rdx, %%rax\n\t"
+#else
+#define TIMESTAMP_TSC_ASM "lfence\n\trdtsc\n\tshl $32, %%rdx\n\tor %%rdx, %%rax\n\t"
+#endif
+#define TIMESTAMP_COUNTER_ASM "mov timer_counter(%%rip), %%rax\n\t"
+
+struct timer_counter_t{
+    volatile uint64_t value;
+    uint8_t padding[56]; // The counter is alone in its cache line
+} __attribute__((aligned(64)));
+
+struct timer_counter_t timer_counter;
+
+/**
+ * @brief Defines a kernel that times a write to addr. SERIALIZE separates the write from the timestamps,
+ * TIMESTAMP reads the timer into rax. Returns the write latency in time and the starting timestamp in timestamp.
+ */
+#define CLOCK_KERNEL(NAME, SERIALIZE, TIMESTAMP) \
+static inline void measure_##NAME(uint64_t* addr, uint64_t* time, uint64_t* timestamp){ \
+    asm volatile( \
+        SERIALIZE                       /* reduce noise by serializing */ \
+        ".rept 27\n\tnop\n\t.endr\n\t"  /* reduce noise by nops */ \
+        TIMESTAMP                       /* start timestamp */ \
+        "mov %%rax, %%r15\n\t"          /* mov timestamp to r15 */ \
+        "movq %%rdx, (%[addr])\n\t"     /* write to the address */ \
+        SERIALIZE                       /* serialize */ \
+        ".rept 11\n\tnop\n\t.endr\n\t"  /* nops for better measurement */ \
+        TIMESTAMP                       /* end timestamp */ \
+        "sub %%r15, %%rax\n\t"          /* compute delta */ \
+        "mov %%rax, %[res]\n\t"         /* output the delta */ \
+        "mov %%r15, %[ts]\n\t"          /* and the timestamp */ \
+        SERIALIZE \
+        : [res]"=r"(*time), [ts]"=r"(*timestamp) : [addr]"r"(addr): "rax", "rbx", "rdx", "rcx", "r15"); \
+}
+
+#define SERIALIZE_INSTR_ASM ".byte 0x0f, 0x01, 0xe8\n\t" // serialize, older assemblers lack the mnemonic
+
+CLOCK_KERNEL(cpuid, "cpuid\n\t", TIMESTAMP_TSC_ASM)
+CLOCK_KERNEL(lfence, "lfence\n\t", TIMESTAMP_TSC_ASM)
+CLOCK_KERNEL(mfence_lfence, "mfence\n\tlfence\n\t", TIMESTAMP_TSC_ASM)
+CLOCK_KERNEL(serialize, SERIALIZE_INSTR_ASM, TIMESTAMP_TSC_ASM)
+CLOCK_KERNEL(cpuid_counter, "cpuid\n\t", TIMESTAMP_COUNTER_ASM)
+CLOCK_KERNEL(lfence_counter, "lfence\n\t", TIMESTAMP_COUNTER_ASM)
+CLOCK_KERNEL(mfence_lfence_counter, "mfence\n\tlfence\n\t", TIMESTAMP_COUNTER_ASM)
+CLOCK_KERNEL(serialize_counter, SERIALIZE_INSTR_ASM, TIMESTAMP_COUNTER_ASM)
+
+// The kernels by timer and serialization
+static void (*const clock_kernels[2][4])(uint64_t*, uint64_t*, uint64_t*) = {
+    {measure_cpuid, measure_lfence, measure_mfence_lfence, measure_serialize},
+    {measure_cpuid_counter, measure_lfence_counter, measure_mfence_lfence_counter, measure_serialize_counter}
+};
+
+/**
+ * @brief Returns the SERIALIZE_* variant with the given name, or -1 if it is unknown or not supported.
+ */
+int parse_serialization(const char* name){
+    unsigned int eax, ebx, ecx, edx;
+    if(strcmp(name, "cpuid") == 0) return SERIALIZE_CPUID;
+    if(strcmp(name, "lfence") == 0) return SERIALIZE_LFENCE;
+    if(strcmp(name, "mfence") == 0) return SERIALIZE_MFENCE_LFENCE;
+    if(strcmp(name, "serialize") == 0 && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (edx & (1 << 14))){
+        return SERIALIZE_INSTR;
+    }
+    return -1;
+}
+
+/**
+ * @brief Returns the current timestamp of the TSC or the counting thread.
+ */
+static inline uint64_t read_timer(int timer){
+    uint64_t ts;
+    if(timer == TIMER_COUNTING_THREAD){
+        return timer_counter.value;
+    }
+    asm volatile(TIMESTAMP_TSC_ASM "mov %%rax, %[ts]\n\t" : [ts]"=r"(ts) : : "rax", "rcx", "rdx");
+    return ts;
+}
+
+/**
+ * @brief Converts a timestamp of the timer to the TSC. A counter timestamp is taken relative to a fresh reading 
+ * of both timers, so the ticks per TSC tick only scale the short distance to now and the drift of the counter 
+ * rate does not accumulate.
+ */
+static uint64_t to_tsc(int timer, uint64_t timestamp, double timer_scale){
+    if(timer == TIMER_TSC){
+        return timestamp;
+    }
+    uint64_t counter = read_timer(TIMER_COUNTING_THREAD);
+    uint64_t tsc = read_timer(TIMER_TSC);
+    return tsc - (uint64_t) ((counter - timestamp) / timer_scale);
+}
+
+/**
+ * @brief Returns an allowed SMT sibling of core, or -1 if it has none.
+ */
+int find_sibling(int core, cpu_set_t* allowed){
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", core);
+    FILE *f = fopen(path, "r");
+    int sibling = -1, first, last;
+    if(!f){
+        return -1;
+    }
+    // The list is a comma separated list of CPUs and ranges, e.g. 1,9 or 2-3
+    while(sibling < 0 && fscanf(f, "%d", &first) == 1){
+        last = first;
+        int c = fgetc(f);
+        if(c == '-' && fscanf(f, "%d", &last) == 1){
+            c = fgetc(f);
+        }
+        for(int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++){
+            if(cpu != core && CPU_ISSET(cpu, allowed)){
+                sibling = cpu;
+                break;
+            }
+        }
+        if(c != ','){
+            break;
+        }
+    }
+    fclose(f);
+    return sibling;
+}
+
+/**
+ * @brief Increments timer_counter forever, the loop of libtea's counting thread.
+ */
+void* counting_thread(void* arg){
+    (void) arg;
+    asm volatile("1: inc %%rax\n\t"
+                 "mov %%rax, (%%rcx)\n\t"
+                 "jmp 1b" : : "c"(&timer_counter.value), "a"(0));
+    return NULL;
+}
+
+/**
+ * @brief Times back-to-back reads of the timer. Prints the median difference, the step of the timer 
+ * (the greatest common divisor of the differences) and the reads per second.
+ * 
+ * @return true if the timer traps or is coarse
+ */
+bool probe_timer(int timer, const char* name){
+    uint64_t deltas[TIMER_PROBE_SAMPLES];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int i = 0; i < TIMER_PROBE_SAMPLES; i++){
+        uint64_t a = read_timer(timer);
+        deltas[i] = read_timer(timer) - a;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    uint64_t resolution = 0, median;
+    for(int i = 0; i < TIMER_PROBE_SAMPLES; i++){
+        uint64_t a = resolution, b = deltas[i];
+        while(b != 0){
+            uint64_t r = a % b;
+            a = b;
+            b = r;
+        }
+        resolution = a;
+        // Insertion sort for the median
+        for(int j = i; j > 0 && deltas[j-1] > deltas[j]; j--){
+            uint64_t t = deltas[j];
+            deltas[j] = deltas[j-1];
+            deltas[j-1] = t;
+        }
+    }
+    median = deltas[TIMER_PROBE_SAMPLES / 2];
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    printf("%s: back-to-back median %lu, resolution %lu, %.0f reads/s\n", name, median, resolution, 
+        2 * TIMER_PROBE_SAMPLES / (ns / 1e9));
+    return median > TSC_TRAP_CYCLES || resolution == 0 || resolution > TSC_MAX_RESOLUTION;
+}
+
+/**
+ * @brief Starts the counting thread on counter_core and returns the counter ticks per TSC tick, 
+ * which scale the TSC based constants of the clock recovery.
+ */
+double start_counting_thread(int counter_core){
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, counting_thread, NULL) != 0){
+        perror("pthread_create");
+        exit(1);
+    }
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(counter_core, &mask);
+    if(pthread_setaffinity_np(thread, sizeof(mask), &mask)){
+        printf("Failed to pin the counting thread to core %d\n", counter_core);
+    }
+    while(timer_counter.value == 0){
+        sched_yield();
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t tsc = read_timer(TIMER_TSC), counter = read_timer(TIMER_COUNTING_THREAD);
+    do{
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }while((now.tv_sec - start.tv_sec) * 1000000000LL + (now.tv_nsec - start.tv_nsec) < TIMER_SCALE_NS);
+    double scale = (read_timer(TIMER_COUNTING_THREAD) - counter) / (double) (read_timer(TIMER_TSC) - tsc);
+    printf("Counting thread on core %d, %.3f ticks per TSC tick\n", counter_core, scale);
+    probe_timer(TIMER_COUNTING_THREAD, "Counting thread");
+    return scale;
+}
 
 
 int main(int argc, char** argv){    
     // The first argument can be used to control the clock divider
     int core = 0;
     int clk_divider = 0;
+    int serialization = SERIALIZE_CPUID;
+    int counter_core = -1;
     char* name = (char*) malloc(50);
-    if(argc == 4) {
+    if(argc >= 4 && argc <= 6) {
         // No attempt is made to filter name, it's up to you to choose something legit
         strncpy(name, argv[1], 50);
         core = atoi(argv[2]);
         clk_divider = atoi(argv[3]);
+        if(argc >= 5 && (serialization = parse_serialization(argv[4])) < 0){
+            printf("Unknown or unsupported serialization %s, use cpuid, lfence, mfence or serialize\n", argv[4]);
+            exit(1);
+        }
+        if(argc == 6){
+            counter_core = atoi(argv[5]);
+        }
     }else{
-        printf("Usage: ./demo [name] [core] [divider]\n");
+        printf("Usage: ./demo [name] [core] [divider] [cpuid|lfence|mfence|serialize] [counter core]\n");
         exit(1);
     }
     
 
-    // set CPU affinity
+    // A core for the counting thread, in case the TSC is not usable. The SMT sibling of core is preferred: it 
+    // reads the counter from the shared L1 and two demos on different cores do not pick the same counter core.
     cpu_set_t  mask;
+    if(counter_core < 0 && sched_getaffinity(0, sizeof(mask), &mask) == 0){
+        counter_core = find_sibling(core, &mask);
+        for(int cpu = 0; counter_core < 0 && cpu < CPU_SETSIZE; cpu++){
+            if(cpu != core && CPU_ISSET(cpu, &mask)){
+                counter_core = cpu;
+                break;
+            }
+        }
+    }
+
+    // set CPU affinity
     CPU_ZERO(&mask);
     CPU_SET(core, &mask);
 
@@ -44,6 +288,18 @@ int main(int argc, char** argv){
 
     printf("Pinned Process to %d. Clock Divider is set to %d. Writing to file %s.txt\n", core, clk_divider, name);
 
+    // Switch to the counting thread if it was requested or the TSC traps or is coarse
+    int timer = TIMER_TSC;
+    double timer_scale = 1;
+    if(probe_timer(TIMER_TSC, "TSC") || argc == 6){
+        if(counter_core < 0){
+            printf("No core left for the counting thread, keeping the TSC\n");
+        }else{
+            timer_scale = start_counting_thread(counter_core);
+            timer = TIMER_COUNTING_THREAD;
+        }
+    }
+
     int64_t ring_buffer[RING_BUFFER_SIZE] = {0};
     int ring_buffer_counter = 0;
     int64_t ring_buffer2[RING_BUFFER_SIZE] = {0};
@@ -55,7 +311,7 @@ int main(int argc, char** argv){
     uint64_t time = 0, timestamp = 0;
     uint64_t last_edge_ts = 0;
     // initialized with some average number we found. Over time, this is updated but it's good to have a somewhat correct mean period
-    uint64_t mean_clk_period = 2147722305; 
+    uint64_t mean_clk_period = 2147722305 * timer_scale; 
     
     bool ready = true;
     bool internal_clk = false;
@@ -65,92 +321,17 @@ int main(int argc, char** argv){
     
 
     // starting timestamp
-    asm volatile(
-        #ifdef HAS_RDTSCP
-        "rdtscp\n\t"                // get timestamp
-        #else
-        "lfence\n\t"
-        "rdtsc\n\t"
-        #endif  
-        "shl $32, %%rdx\n\t"       // rdx << 32
-        "or %%rdx, %%rax\n\t"      // rax = rdx | rax
-        "mov %%rax, %[ts]\n\t"     // return rax
-        :[ts]"=r"(last_edge_ts)::"eax", "ecx", "edx");
+    last_edge_ts = read_timer(timer);
 
     uint64_t last_out = last_edge_ts;
 
     while(clk_cnt < 100){
         time = 0;
 
-        asm volatile(
-            //"mfence\n\t"
-            "cpuid\n\t"                 // reduce noise by serializing
-            "nop\n\t"                   // reduce noise by nops
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            #ifdef HAS_RDTSCP
-            "rdtscp\n\t"                    // start timestamp
-            #else
-            "lfence\n\t"
-            "rdtsc\n\t"
-            #endif
-            "shl $32, %%rdx\n\t"            // combine the timestamp
-            "or %%rdx, %%rax\n\t"
-            "mov %%rax, %%r15\n\t"          // mov timestamp to r15 
-            "movq %%rdx, (%[addr])\n\t"     // write to the address
-            //"mfence\n\t"
-            "cpuid\n\t"                     // serialize
-            "nop\n\t"                       // nops for better measurement
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            #ifdef HAS_RDTSCP
-            "rdtscp\n\t"                    // end timestamp
-            #else
-            "lfence\n\t"
-            "rdtsc\n\t"
-            #endif
-            "shl $32, %%rdx\n\t"            // combine the timestamp
-            "or %%rdx, %%rax\n\t"
-            "sub %%r15, %%rax\n\t"          // compute delta
-            "mov %%rax, %[res]\n\t"         // output the timestamp
-            "mov %%r15, %[ts]\n\t"          // and the delta
-            "cpuid\n\t"
-            : [res]"=r"(time), [ts]"=r"(timestamp) : [addr]"r"(addr): "rax", "ebx", "rdx", "rcx", "r15");
+        clock_kernels[timer][serialization](addr, &time, &timestamp);
         
         // Filter outliers
-        if (time < 1600){
+        if (time < 1600 * timer_scale){
             // insert measurement to ring buffer
             ring_buffer[ring_buffer_counter] = time;
             ring_buffer_counter ++;
@@ -175,7 +356,7 @@ int main(int argc, char** argv){
             double normalized = get_avg(ring_buffer2, RING_BUFFER_SIZE);
             
             // Spike detection in ring buffer 2 (positive change)
-            if(normalized > 17 && internal_clk == false && ready){
+            if(normalized > 17 * timer_scale && internal_clk == false && ready){
                 // Adjust the mean clk period
                 mean_clk_period = mean_clk_period - \
                     (mean_clk_period / CLK_MOVING_AVERAGE_WINDOW) + \
@@ -190,7 +371,7 @@ int main(int argc, char** argv){
             }
 
             // Spike detection in ring buffer 2 (negative change)
-            if(normalized < -17 && internal_clk == true && ready){
+            if(normalized < -17 * timer_scale && internal_clk == true && ready){
                 // Adjust the mean clk period
                 mean_clk_period = mean_clk_period - \
                     (mean_clk_period / CLK_MOVING_AVERAGE_WINDOW) + \
@@ -211,7 +392,7 @@ int main(int argc, char** argv){
         // Periodically change clk based on timing or if an edge is reported
         if(((int64_t)timestamp - last_out >= output_period && divide_ctr < clk_divider-2) || sync){
             last_out = timestamp;
-            fprintf(f, "%ld %d\n", timestamp, internal_clk);
+            fprintf(f, "%lu %d\n", to_tsc(timer, timestamp, timer_scale), internal_clk);
             //args->edge_detected = true;
             divide_ctr ++;
             if(sync){
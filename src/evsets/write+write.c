@@ -1,130 +1,1002 @@
+#define _GNU_SOURCE
 #include "write+write.h"
 
+// State of the construction, per worker thread
+__thread uint64_t measurement_ctr = 0;
+__thread uint64_t test_ctr = 0;
+__thread uint64_t inconclusive_ctr = 0;
+__thread struct outlier_stats_t outlier_stats;
+__thread uint64_t deadline_ns = 0;
+__thread struct evset_arena_t evset_arena = {NULL, 0, 0};
+__thread bool verbose = true;
+double test_ns_per_address = 0;
+uint64_t cache_miss_threshold = CACHE_MISS_THRESHOLD;
+uint64_t outlier_threshold = OUTLIER_THRESHOLD;
+int serialization = SERIALIZE_CPUID;
+write_kernel_t generated_kernel = NULL;
+write_kernel_t generated_overhead_kernel = NULL;
+struct kernel_config_t generated_config;
+int timer = TIMER_TSC;
+struct timer_counter_t timer_counter;
+uint64_t load_overhead = 0;
+uint64_t write_overhead = 0;
+double timer_scale = 1;
+uint64_t probe_min = PROBE_MIN_CYCLES;
+uint64_t probe_max = PROBE_MAX_CYCLES;
+double diff_threshold = DIFF_THRESHOLD;
+double sprt_effect = SPRT_EFFECT;
+double sprt_variance = 0;
+struct llc_info_t llc = {CACHE_ASSOC, 0, 64, 0, 0, LLC_SET_MASK, "defaults"};
+int group_size = GROUP_SIZE;
 
-struct eviction_set_t* get_evset(uint64_t* addr_space, uint64_t* victim, uint64_t addr_space_size){ 
-    
+// Serializing sequences of the Write+Write kernels, see SERIALIZE_* in write+write.h
+#define SERIALIZE_CPUID_ASM "mfence\n\tcpuid\n\t"
+#define SERIALIZE_LFENCE_ASM "lfence\n\t"
+#define SERIALIZE_MFENCE_LFENCE_ASM "mfence\n\tlfence\n\t"
+#define SERIALIZE_INSTR_ASM ".byte 0x0f, 0x01, 0xe8\n\t" // serialize, older assemblers lack the mnemonic
+
+// Timestamps of the kernels in rax, see TIMER_* in write+write.h
+#define TIMESTAMP_TSC_ASM "rdtscp\n\tshl $32, %%rdx\n\tor %%rdx, %%rax\n\t"
+#define TIMESTAMP_COUNTER_ASM "mov timer_counter(%%rip), %%rax\n\t"
+
+/**
+ * @brief Defines a Write+Write kernel that writes to candidate_0 (decision == 0) or candidate_1 
+ * (decision == 1) and times a subsequent write to the victim address. SERIALIZE separates the 
+ * writes from the timestamps, TIMESTAMP reads the timer into rax.
+ */
+#define MEASURE_WRITE_KERNEL(NAME, SERIALIZE, TIMESTAMP) \
+static inline uint64_t measure_write_##NAME(uint64_t* victim, void* candidate_0, void* candidate_1, int decision){ \
+    uint64_t time; \
+    asm volatile( \
+        SERIALIZE                           /* Clear all active instructions before we start */ \
+        "clflush (%[victim])\n\t"           /* Flush the victim address */ \
+        "test %[decision], %[decision]\n\t" /* test if decision = 0 */ \
+        "lea (%[candidate_0]), %%rax\n\t"   /* rax = *candidate0 */ \
+        "lea (%[candidate_1]), %%rbx\n\t"   /* rbx = *candidate1 */ \
+        "cmove %%rax, %%rcx\n\t"            /* conditional move -> if decision == 1, rcx=rax */ \
+        "cmovne %%rbx, %%rcx\n\t"           /* else -> rcx = rbx */ \
+        "movq %%rax, (%%rcx)\n\t"           /* write to rcx */ \
+        SERIALIZE \
+        ".rept 16\n\tnop\n\t.endr\n\t"      /* alignment, reduces the number of outliers */ \
+        TIMESTAMP                           /* start the timing */ \
+        "mov %%rax, %%r15\n\t"              /* move timestamp out of the way */ \
+        "movq %%rdx, (%[victim])\n\t"       /* write to the victim address */ \
+        SERIALIZE \
+        ".rept 11\n\tnop\n\t.endr\n\t"      /* nops for improved stability of timing measurement */ \
+        TIMESTAMP                           /* get the timestamp */ \
+        "sub %%r15, %%rax\n\t"              /* compute the difference from the first timestamp */ \
+        "mov %%rax, %[out]\n\t" \
+        : [out]"=r"(time) : [decision]"r"(decision), [candidate_0]"r"(candidate_0), [candidate_1]"r"(candidate_1), [victim]"r"(victim) : "rax", "rbx", "rcx", "rdx", "r15" \
+    ); \
+    return time; \
+}
+
+/**
+ * @brief Defines a Write+Write kernel with k candidate writes. Writes to all candidates and times 
+ * a subsequent write to the victim address.
+ */
+#define MEASURE_WRITE_MULTI_KERNEL(NAME, SERIALIZE, TIMESTAMP) \
+static inline uint64_t measure_write_multi_##NAME(uint64_t* victim, void** candidates, uint64_t k){ \
+    uint64_t time; \
+    asm volatile( \
+        SERIALIZE                           /* Clear all active instructions before we start */ \
+        "clflush (%[victim])\n\t"           /* Flush the victim address */ \
+        "xor %%rcx, %%rcx\n\t"              /* rcx = 0 */ \
+        "1:\n\t" \
+        "mov (%[candidates], %%rcx, 8), %%rax\n\t" /* rax = candidates[rcx] */ \
+        "movq %%rax, (%%rax)\n\t"           /* write to the candidate */ \
+        "inc %%rcx\n\t" \
+        "cmp %[k], %%rcx\n\t" \
+        "jb 1b\n\t"                         /* next candidate */ \
+        SERIALIZE \
+        ".rept 16\n\tnop\n\t.endr\n\t"      /* alignment */ \
+        TIMESTAMP                           /* start the timing */ \
+        "mov %%rax, %%r15\n\t"              /* move timestamp out of the way */ \
+        "movq %%rdx, (%[victim])\n\t"       /* write to the victim address */ \
+        SERIALIZE \
+        ".rept 11\n\tnop\n\t.endr\n\t"      /* nops for improved stability of timing measurement */ \
+        TIMESTAMP                           /* get the timestamp */ \
+        "sub %%r15, %%rax\n\t"              /* compute the difference from the first timestamp */ \
+        "mov %%rax, %[out]\n\t" \
+        : [out]"=r"(time) : [candidates]"r"(candidates), [k]"r"(k), [victim]"r"(victim) : "rax", "rbx", "rcx", "rdx", "r15", "memory" \
+    ); \
+    return time; \
+}
+
+/**
+ * @brief Defines the empty Write+Write kernel: the timed region without the victim write, which is the 
+ * timer overhead contained in every measurement.
+ */
+#define MEASURE_OVERHEAD_KERNEL(NAME, SERIALIZE, TIMESTAMP) \
+static inline uint64_t measure_overhead_##NAME(){ \
+    uint64_t time; \
+    asm volatile( \
+        SERIALIZE \
+        ".rept 16\n\tnop\n\t.endr\n\t" \
+        TIMESTAMP                           /* start the timing */ \
+        "mov %%rax, %%r15\n\t"              /* move timestamp out of the way */ \
+        SERIALIZE \
+        ".rept 11\n\tnop\n\t.endr\n\t" \
+        TIMESTAMP                           /* get the timestamp */ \
+        "sub %%r15, %%rax\n\t"              /* compute the difference from the first timestamp */ \
+        "mov %%rax, %[out]\n\t" \
+        : [out]"=r"(time) : : "rax", "rbx", "rcx", "rdx", "r15" \
+    ); \
+    return time; \
+}
+
+MEASURE_WRITE_KERNEL(cpuid, SERIALIZE_CPUID_ASM, TIMESTAMP_TSC_ASM)
+MEASURE_WRITE_KERNEL(lfence, SERIALIZE_LFENCE_ASM, TIMESTAMP_TSC_ASM)
+MEASURE_WRITE_KERNEL(mfence_lfence, SERIALIZE_MFENCE_LFENCE_ASM, TIMESTAMP_TSC_ASM)
+MEASURE_WRITE_KERNEL(serialize, SERIALIZE_INSTR_ASM, TIMESTAMP_TSC_ASM)
+MEASURE_WRITE_KERNEL(cpuid_counter, SERIALIZE_CPUID_ASM, TIMESTAMP_COUNTER_ASM)
+MEASURE_WRITE_KERNEL(lfence_counter, SERIALIZE_LFENCE_ASM, TIMESTAMP_COUNTER_ASM)
+MEASURE_WRITE_KERNEL(mfence_lfence_counter, SERIALIZE_MFENCE_LFENCE_ASM, TIMESTAMP_COUNTER_ASM)
+MEASURE_WRITE_KERNEL(serialize_counter, SERIALIZE_INSTR_ASM, TIMESTAMP_COUNTER_ASM)
+MEASURE_WRITE_MULTI_KERNEL(cpuid, SERIALIZE_CPUID_ASM, TIMESTAMP_TSC_ASM)
+MEASURE_WRITE_MULTI_KERNEL(lfence, SERIALIZE_LFENCE_ASM, TIMESTAMP_TSC_ASM)
+MEASURE_WRITE_MULTI_KERNEL(mfence_lfence, SERIALIZE_MFENCE_LFENCE_ASM, TIMESTAMP_TSC_ASM)
+MEASURE_WRITE_MULTI_KERNEL(serialize, SERIALIZE_INSTR_ASM, TIMESTAMP_TSC_ASM)
+MEASURE_WRITE_MULTI_KERNEL(cpuid_counter, SERIALIZE_CPUID_ASM, TIMESTAMP_COUNTER_ASM)
+MEASURE_WRITE_MULTI_KERNEL(lfence_counter, SERIALIZE_LFENCE_ASM, TIMESTAMP_COUNTER_ASM)
+MEASURE_WRITE_MULTI_KERNEL(mfence_lfence_counter, SERIALIZE_MFENCE_LFENCE_ASM, TIMESTAMP_COUNTER_ASM)
+MEASURE_WRITE_MULTI_KERNEL(serialize_counter, SERIALIZE_INSTR_ASM, TIMESTAMP_COUNTER_ASM)
+MEASURE_OVERHEAD_KERNEL(cpuid, SERIALIZE_CPUID_ASM, TIMESTAMP_TSC_ASM)
+MEASURE_OVERHEAD_KERNEL(lfence, SERIALIZE_LFENCE_ASM, TIMESTAMP_TSC_ASM)
+MEASURE_OVERHEAD_KERNEL(mfence_lfence, SERIALIZE_MFENCE_LFENCE_ASM, TIMESTAMP_TSC_ASM)
+MEASURE_OVERHEAD_KERNEL(serialize, SERIALIZE_INSTR_ASM, TIMESTAMP_TSC_ASM)
+MEASURE_OVERHEAD_KERNEL(cpuid_counter, SERIALIZE_CPUID_ASM, TIMESTAMP_COUNTER_ASM)
+MEASURE_OVERHEAD_KERNEL(lfence_counter, SERIALIZE_LFENCE_ASM, TIMESTAMP_COUNTER_ASM)
+MEASURE_OVERHEAD_KERNEL(mfence_lfence_counter, SERIALIZE_MFENCE_LFENCE_ASM, TIMESTAMP_COUNTER_ASM)
+MEASURE_OVERHEAD_KERNEL(serialize_counter, SERIALIZE_INSTR_ASM, TIMESTAMP_COUNTER_ASM)
+
+// The kernels by timer and serialization
+static const write_kernel_t write_kernels[TIMERS][SERIALIZE_VARIANTS] = {
+    {measure_write_cpuid, measure_write_lfence, measure_write_mfence_lfence, measure_write_serialize},
+    {measure_write_cpuid_counter, measure_write_lfence_counter, measure_write_mfence_lfence_counter, 
+        measure_write_serialize_counter}
+};
+static uint64_t (*const write_multi_kernels[TIMERS][SERIALIZE_VARIANTS])(uint64_t*, void**, uint64_t) = {
+    {measure_write_multi_cpuid, measure_write_multi_lfence, measure_write_multi_mfence_lfence, measure_write_multi_serialize},
+    {measure_write_multi_cpuid_counter, measure_write_multi_lfence_counter, measure_write_multi_mfence_lfence_counter, 
+        measure_write_multi_serialize_counter}
+};
+static uint64_t (*const overhead_kernels[TIMERS][SERIALIZE_VARIANTS])() = {
+    {measure_overhead_cpuid, measure_overhead_lfence, measure_overhead_mfence_lfence, measure_overhead_serialize},
+    {measure_overhead_cpuid_counter, measure_overhead_lfence_counter, measure_overhead_mfence_lfence_counter, 
+        measure_overhead_serialize_counter}
+};
+
+/**
+ * @brief Performs a single Write+Write measurement with the generated kernel (-j) or the selected timer and 
+ * serialization. Writes to candidate_0 (decision == 0) or candidate_1 (decision == 1) and times a subsequent 
+ * write to the victim address.
+ * 
+ * @return the number of cycles of the victim write
+ */
+static inline uint64_t measure_write(uint64_t* victim, void* candidate_0, void* candidate_1, int decision){
+    measurement_ctr++;
+    if(generated_kernel != NULL){
+        return generated_kernel(victim, candidate_0, candidate_1, decision);
+    }
+    return write_kernels[timer][serialization](victim, candidate_0, candidate_1, decision);
+}
+
+/**
+ * @brief Performs a single Write+Write measurement with k candidate writes and the selected timer and serialization. 
+ * Writes to all candidates and times a subsequent write to the victim address.
+ * 
+ * @return the number of cycles of the victim write
+ */
+static inline uint64_t measure_write_multi(uint64_t* victim, void** candidates, uint64_t k){
+    measurement_ctr++;
+    return write_multi_kernels[timer][serialization](victim, candidates, k);
+}
+
+/**
+ * @brief Times the empty kernel of the generated kernel (-j) or the selected timer and serialization.
+ * 
+ * @return the timer overhead of a Write+Write measurement in cycles
+ */
+static inline uint64_t measure_overhead(uint64_t* victim, void* candidate){
+    if(generated_overhead_kernel != NULL){
+        return generated_overhead_kernel(victim, candidate, candidate, 0);
+    }
+    return overhead_kernels[timer][serialization]();
+}
+
+/**
+ * @brief Measures the victim write after writing the k addresses of group_0 (decision == 0) or 
+ * group_1 (decision == 1) and repeats the measurement until it is below the outlier threshold.
+ * 
+ * @param skipped -> set to true if the pair or the scan ran out of outlier retries, the time is then invalid
+ */
+static inline uint64_t sample_write(uint64_t* victim, void** group_0, void** group_1, int k, int decision, int* outliers, 
+        bool* skipped){
     uint64_t time;
+    *skipped = false;
+    while(true){
+        if(k == 1){
+            time = measure_write(victim, group_0[0], group_1[0], decision);
+        }else{
+            time = measure_write_multi(victim, decision ? group_1 : group_0, k);
+        }
+        if(time <= outlier_threshold){ // The outlier threshold is kinda important in finetuning the evset construction. Ideal value depends on the CPU.
+            return time;
+        }
+        // Retry the outlier, unless the pair or the scan ran out of retries
+        (*outliers)++;
+        outlier_stats.scan_outliers++;
+        if(*outliers > PAIR_OUTLIER_BUDGET || outlier_stats.scan_outliers > SCAN_OUTLIER_BUDGET){
+            *skipped = true;
+            return time;
+        }
+    }
+}
+
+/**
+ * @brief Records the outliers of one classification.
+ */
+static void account_outliers(int outliers, void* candidate, bool skipped){
+    int bin = 0;
+    while(bin < OUTLIER_HIST_BINS - 1 && (1 << bin) <= outliers){
+        bin++;
+    }
+    outlier_stats.hist[bin]++;
+    outlier_stats.classifications++;
+    outlier_stats.outliers += outliers;
+    if(skipped){
+        outlier_stats.skipped++;
+    }
+    if((uint64_t) outliers > outlier_stats.worst){
+        outlier_stats.worst = outliers;
+        outlier_stats.worst_candidate = candidate;
+    }
+}
+
+/**
+ * @brief Prints the outlier counters of all classifications so far.
+ */
+void print_outlier_stats(){
+    printf("Outliers: %lu in %lu classifications, %lu skipped, %lu candidates dropped\n", outlier_stats.outliers, 
+        outlier_stats.classifications, outlier_stats.skipped, outlier_stats.dropped);
+    printf("Outliers per classification:");
+    for(int bin = 0; bin < OUTLIER_HIST_BINS; bin++){
+        if(bin < 2){
+            printf("%s%d: %lu", bin ? ", " : " ", bin, outlier_stats.hist[bin]);
+        }else if(bin == OUTLIER_HIST_BINS - 1){
+            printf(", >=%d: %lu", 1 << (bin-1), outlier_stats.hist[bin]);
+        }else{
+            printf(", %d-%d: %lu", 1 << (bin-1), (1 << bin) - 1, outlier_stats.hist[bin]);
+        }
+    }
+    printf("\n");
+    if(outlier_stats.worst > 0){
+        printf("Most outliers: %lu at candidate %p\n", outlier_stats.worst, outlier_stats.worst_candidate);
+    }
+}
+
+/**
+ * @brief Classifies two candidate groups of k addresses with a fixed number of 2*RUNS measurements.
+ * 
+ * @param mean -> returns the mean victim write time after writing group 0 / group 1
+ * @return COLLISION_0 or COLLISION_1 if the respective group collides with the victim, PAIR_SKIPPED if 
+ * the retry budget for outliers was exceeded, NO_COLLISION else
+ */
+int classify_groups_fixed(uint64_t* victim, void** group_0, void** group_1, int k, double mean[2]){
+    volatile int decision = 0;
+    int outliers = 0;
+    mean[0] = 0;
+    mean[1] = 0;
+
+    for(int ctr = 0; ctr != 2*RUNS; ctr++){
+        decision = (ctr & 0x2) >> 1;
+        bool skipped;
+        uint64_t time = sample_write(victim, group_0, group_1, k, decision, &outliers, &skipped);
+        if(skipped){
+            account_outliers(outliers, group_0[0], true);
+            return PAIR_SKIPPED;
+        }
+        // Store the measured time
+        mean[decision] += time;
+    }
+    account_outliers(outliers, group_0[0], false);
+    // Compute the means
+    mean[0] /= RUNS;
+    mean[1] /= RUNS;
+
+    // Check if we have a significant difference in means.
+    if(fabs(mean[0]-mean[1]) <= diff_threshold){
+        return NO_COLLISION;
+    }
+    // If the difference is positive, candidate 0 collides
+    return mean[0]-mean[1] > 0 ? COLLISION_0 : COLLISION_1;
+}
+
+/**
+ * @brief Classifies two candidate groups of k addresses with a sequential probability ratio test.
+ * 
+ * Measurements are taken in rounds of two writes per group. Each round yields one observation 
+ * x = mean(group 0) - mean(group 1). We test H0: E[x] = 0 against H+: E[x] = +SPRT_EFFECT
+ * (group 0 collides) and H-: E[x] = -SPRT_EFFECT (group 1 collides), using the running variance 
+ * of x. Sampling stops as soon as one of the hypotheses is accepted with the error rates SPRT_ALPHA 
+ * (false positive) and SPRT_BETA (false negative). After SPRT_MAX_RUNS measurements, we fall back 
+ * to the difference of means as in the fixed sample test. The variance of x is the one calibrate() measured 
+ * for non-colliding pairs, so a decision is possible after the first round. A noisier pair raises it with its 
+ * running variance.
+ * 
+ * @param mean -> returns the mean victim write time after writing group 0 / group 1
+ * @return COLLISION_0 or COLLISION_1 if the respective group collides with the victim, PAIR_SKIPPED if 
+ * the retry budget for outliers was exceeded, NO_COLLISION else
+ */
+int classify_groups_sprt(uint64_t* victim, void** group_0, void** group_1, int k, double mean[2]){
     volatile int decision = 0;
-    volatile int decision_ctr = 0;
-    int success_ctr = 0, failure_ctr = 0;
+    double round[2] = {0, 0};
+    double sum[2] = {0, 0};
+    int n[2] = {0, 0};
+    // Welford's online variance of the per-round observations
+    double x_mean = 0, x_m2 = 0;
+    int rounds = 0;
+    int verdict = -1;
+    int outliers = 0;
+
+    // Decision boundaries. The false positive rate is split between both alternatives.
+    const double upper = log((1 - SPRT_BETA) / (SPRT_ALPHA / 2));
+    const double lower = log(SPRT_BETA / (1 - SPRT_ALPHA / 2));
+    const double delta = sprt_effect;
+
+    for(int ctr = 0; ctr != SPRT_MAX_RUNS; ctr++){
+        decision = (ctr & 0x2) >> 1;
+        bool skipped;
+        uint64_t time = sample_write(victim, group_0, group_1, k, decision, &outliers, &skipped);
+        if(skipped){
+            account_outliers(outliers, group_0[0], true);
+            return PAIR_SKIPPED;
+        }
+        round[decision] += time;
+        sum[decision] += time;
+        n[decision]++;
+
+        // A round is complete after two measurements for each candidate
+        if((ctr & 0x3) != 0x3){
+            continue;
+        }
+        double x = (round[0] - round[1]) / 2;
+        round[0] = 0;
+        round[1] = 0;
+        rounds++;
+        double d = x - x_mean;
+        x_mean += d / rounds;
+        x_m2 += d * (x - x_mean);
+
+        if(rounds < SPRT_MIN_ROUNDS){
+            continue;
+        }
+        // Without calibration, a lower bound avoids overconfident decisions on a lucky streak of equal samples
+        double var = sprt_variance > 0 ? sprt_variance : delta * delta / 4.0;
+        if(rounds > 1 && x_m2 / (rounds - 1) > var){
+            var = x_m2 / (rounds - 1);
+        }
+
+        // Log-likelihood ratios of H+ and H- against H0 for Gaussian observations
+        double s = x_mean * rounds;
+        double llr_0 = (delta * s - rounds * delta * delta / 2) / var;
+        double llr_1 = (-delta * s - rounds * delta * delta / 2) / var;
+
+        if(llr_0 >= upper){
+            verdict = COLLISION_0;
+        }else if(llr_1 >= upper){
+            verdict = COLLISION_1;
+        }else if(llr_0 <= lower && llr_1 <= lower){
+            verdict = NO_COLLISION;
+        }
+        if(verdict != -1){
+            break;
+        }
+    }
+
+    account_outliers(outliers, group_0[0], false);
+    mean[0] = sum[0] / n[0];
+    mean[1] = sum[1] / n[1];
+    if(verdict != -1){
+        return verdict;
+    }
+    // Truncated test: decide on the difference of means
+    if(fabs(mean[0]-mean[1]) <= diff_threshold){
+        return NO_COLLISION;
+    }
+    return mean[0]-mean[1] > 0 ? COLLISION_0 : COLLISION_1;
+}
+
+/**
+ * @brief Classifies two candidate groups of k addresses, with the sequential test if SPRT is defined.
+ */
+int classify_groups(uint64_t* victim, void** group_0, void** group_1, int k, double mean[2]){
+    #ifdef SPRT
+    return classify_groups_sprt(victim, group_0, group_1, k, mean);
+    #else
+    return classify_groups_fixed(victim, group_0, group_1, k, mean);
+    #endif // SPRT
+}
+
+/**
+ * @brief Classifies a candidate pair, see classify_groups.
+ */
+int classify_pair(uint64_t* victim, void* candidate_0, void* candidate_1, double mean[2]){
+    return classify_groups(victim, &candidate_0, &candidate_1, 1, mean);
+}
+
+#ifdef GROUP_TESTING
+/**
+ * @brief Adaptive group testing. Measures the k candidates as one group against k control addresses.
+ * A group without collision rules out all k candidates at once, a colliding group is split in halves 
+ * until the colliding candidates are isolated. These are appended to the eviction set.
+ * 
+ * @param pool -> the pool of the candidates
+ * @param ev_set -> the eviction set the colliding candidates are appended to
+ * @param requeue -> candidates of groups that exceeded the outlier budget, NULL to drop them
+ * @param success_ctr -> incremented for every colliding candidate (with libtea: that is in the victim's set)
+ * @param failure_ctr -> with libtea: incremented for every false positive
+ */
+void group_test(struct candidate_pool_t* pool, uint64_t* victim, void** candidates, void** controls, int k, struct eviction_set_t* ev_set, 
+        struct candidate_queue_t* requeue, int* success_ctr, int* failure_ctr){
+    double mean[2];
+    int result = classify_groups(victim, candidates, controls, k, mean);
+    if(result == PAIR_SKIPPED && requeue != NULL){
+        // Try again at the end of the scan, the pages stay resident until then
+        memcpy(&requeue->candidates[requeue->len], candidates, k * sizeof(void*));
+        requeue->len += k;
+        return;
+    }
+    if(result == PAIR_SKIPPED){
+        outlier_stats.dropped += k;
+    }
+    if(result != COLLISION_0){
+        #ifdef SPARSE_POOL
+        for(int j = 0; j < k; j++){
+            release_candidate(pool, candidates[j]);
+        }
+        #endif // SPARSE_POOL
+        return;
+    }
+    if(k == 1){
+        #ifdef SPARSE_POOL
+        pin_candidate(pool, candidates[0]);
+        #endif // SPARSE_POOL
+        // Add the address to the eviction set.
+        append_evset_address(ev_set, candidates[0]);
+        #ifdef USE_LIBTEA
+        size_t vpaddr = libtea_get_physical_address(instance, (size_t)victim);
+        size_t paddr = libtea_get_physical_address(instance, (size_t)candidates[0]);
+        if(libtea_get_cache_set(instance, vpaddr) == libtea_get_cache_set(instance, paddr)){
+            (*success_ctr)++;
+        }else{
+            (*failure_ctr)++;
+        }
+        #else
+        (*success_ctr)++;
+        #endif // USE_LIBTEA
+        return;
+    }
+    group_test(pool, victim, candidates, controls, k/2, ev_set, requeue, success_ctr, failure_ctr);
+    group_test(pool, victim, candidates + k/2, controls, k - k/2, ev_set, requeue, success_ctr, failure_ctr);
+}
+#endif // GROUP_TESTING
+
+/**
+ * @brief Returns the number of bytes of the mapping containing addr that are backed by transparent huge pages.
+ */
+uint64_t get_anon_huge_bytes(void* addr){
+    FILE *f = fopen("/proc/self/smaps", "r");
+    if(!f){
+        return 0;
+    }
+    char line[256];
+    uint64_t start, end, kb = 0;
+    bool found = false;
+    while(fgets(line, sizeof(line), f)){
+        if(sscanf(line, "%lx-%lx ", &start, &end) == 2){
+            found = (uint64_t) addr >= start && (uint64_t) addr < end;
+        }else if(found && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1){
+            break;
+        }
+    }
+    fclose(f);
+    return kb * 1024;
+}
+
+/**
+ * @brief Allocates the array in which eviction set addresses are searched. With USE_HUGEPAGES, the array is backed 
+ * by 2 MiB pages from hugetlbfs (MAP_HUGETLB) or, if no huge pages are reserved, by transparent huge pages.
+ * 
+ * @param size -> the size of the array in bytes
+ * @return true if successful
+ * @return false else
+ */
+bool alloc_candidate_pool(struct candidate_pool_t* pool, uint64_t size){
+    pool->page_size = 0x1000;
+    #ifdef USE_HUGEPAGES
+    size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    pool->mapping_size = size;
+    pool->mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB | POOL_MAP_FLAGS, -1, 0);
+    if(pool->mapping != MAP_FAILED){
+        pool->page_size = HUGE_PAGE_SIZE;
+        pool->base = pool->mapping;
+        pool->size = size;
+        printf("Candidate pool: %lu MB of hugetlbfs pages\n", size >> 20);
+        return true;
+    }
+    // Fallback to transparent huge pages. Over-allocate to align the array to the huge page size.
+    pool->mapping_size = size + HUGE_PAGE_SIZE;
+    #else
+    pool->mapping_size = size;
+    #endif // USE_HUGEPAGES
+    #if defined(USE_HUGEPAGES)
+    // Transparent huge pages are only used if the range is faulted in after the madvise
+    pool->mapping = mmap(NULL, pool->mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    #else
+    pool->mapping = mmap(NULL, pool->mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | POOL_MAP_FLAGS, -1, 0);
+    #endif // USE_HUGEPAGES
+    if(pool->mapping == MAP_FAILED){
+        printf("Could not allocate the candidate pool\n");
+        return false;
+    }
+    pool->base = pool->mapping;
+    pool->size = size;
+    #ifdef USE_HUGEPAGES
+    pool->base = (void*) (((uint64_t) pool->mapping + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+    if(madvise(pool->base, size, MADV_HUGEPAGE) == 0){
+        // Fault in the first huge page and check whether the kernel actually backed it with a huge page
+        ((volatile uint8_t*) pool->base)[0] = 1;
+        if(get_anon_huge_bytes(pool->base) >= HUGE_PAGE_SIZE){
+            pool->page_size = HUGE_PAGE_SIZE;
+        }
+    }
+    printf("Candidate pool: %lu MB, %s\n", size >> 20, pool->page_size == HUGE_PAGE_SIZE ? 
+        "transparent huge pages" : "no huge pages available, using 4 KiB pages");
+    #endif // USE_HUGEPAGES
+    return true;
+}
+
+void free_candidate_pool(struct candidate_pool_t* pool){
+    #ifdef SPARSE_POOL
+    free(pool->page_state);
+    #endif // SPARSE_POOL
+    munmap(pool->mapping, pool->mapping_size);
+}
+
+#ifdef SPARSE_POOL
+/**
+ * @brief Faults in the pages of the candidates [first, first+count) right before they are measured, so that no 
+ * page fault happens within the timed measurements. With PREFAULT_POOL, the pages are also locked.
+ */
+void prefault_candidates(struct candidate_pool_t* pool, uint64_t first, uint64_t count){
+    for(uint64_t i = first; i < first + count; i++){
+        volatile uint64_t *candidate = get_candidate(pool, i);
+        *candidate = 0;
+        #ifdef PREFAULT_POOL
+        mlock((void*) ((uint64_t) candidate & ~(pool->page_size - 1)), pool->page_size);
+        #endif // PREFAULT_POOL
+    }
+}
+
+/**
+ * @brief Like prefault_candidates, but for the candidates [first, first+count) of list if it is not NULL.
+ */
+static void prefault_scan(struct candidate_pool_t* pool, void** list, uint64_t first, uint64_t count){
+    if(list == NULL){
+        prefault_candidates(pool, first, count);
+        return;
+    }
+    for(uint64_t i = first; i < first + count; i++){
+        *(volatile uint64_t*) list[i] = 0;
+        #ifdef PREFAULT_POOL
+        mlock((void*) ((uint64_t) list[i] & ~(pool->page_size - 1)), pool->page_size);
+        #endif // PREFAULT_POOL
+    }
+}
+
+/**
+ * @brief Keeps the page of a colliding candidate mapped.
+ */
+void pin_candidate(struct candidate_pool_t* pool, void* candidate){
+    pool->page_state[((uint8_t*) candidate - (uint8_t*) pool->base) / pool->page_size] = PAGE_PINNED;
+}
+
+/**
+ * @brief Marks a candidate as non-colliding. Once all candidates of a page are non-colliding, 
+ * the page is returned to the kernel. Candidates in the keep range are skipped, their pages host 
+ * the control addresses of the current scan.
+ */
+void release_candidate(struct candidate_pool_t* pool, void* candidate){
+    uint64_t index = ((uint8_t*) candidate - pool->first) / pool->stride;
+    if(index >= pool->keep_first && index < pool->keep_first + pool->keep_count){
+        return;
+    }
+    uint64_t page = ((uint8_t*) candidate - (uint8_t*) pool->base) / pool->page_size;
+    if(pool->page_state[page] == PAGE_PINNED){
+        return;
+    }
+    pool->page_state[page]++;
+    if(pool->page_state[page] < pool->page_size / pool->stride){
+        return;
+    }
+    void* addr = (uint8_t*) pool->base + page * pool->page_size;
+    munlock(addr, pool->page_size);
+    if(madvise(addr, pool->page_size, MADV_DONTNEED) != 0){
+        // Older kernels do not support MADV_DONTNEED on hugetlbfs pages
+        munmap(addr, pool->page_size);
+    }
+    pool->released_pages++;
+}
+
+/**
+ * @brief Releases the non-colliding candidates of the keep range once the scan no longer needs the control addresses.
+ */
+void release_kept_candidates(struct candidate_pool_t* pool){
+    uint64_t first = pool->keep_first, count = pool->keep_count;
+    pool->keep_count = 0;
+    for(uint64_t i = first; i < first + count; i++){
+        void* candidate = get_candidate(pool, i);
+        if(pool->page_state[((uint8_t*) candidate - (uint8_t*) pool->base) / pool->page_size] != PAGE_PINNED){
+            release_candidate(pool, candidate);
+        }
+    }
+}
+#endif // SPARSE_POOL
+
+/**
+ * @brief Returns the number of page faults of the process so far.
+ */
+uint64_t get_page_faults(){
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+/**
+ * @brief Prints the peak resident set size of the process and the pages returned to the kernel.
+ */
+void print_memory_usage(struct candidate_pool_t* pool){
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Peak RSS: %.1f MB of a %.1f MB candidate pool\n", usage.ru_maxrss / 1024.0, pool->size / (1024.0*1024.0));
+    #ifdef SPARSE_POOL
+    printf("Released pages: %lu\n", pool->released_pages);
+    #endif // SPARSE_POOL
+}
+
+#ifdef PREFAULT_POOL
+struct touch_args_t{
+    uint8_t *start;
+    uint64_t size;
+};
+
+/**
+ * @brief Writes to every 4 KiB page of the range. A write fault allocates a private page right away, 
+ * a read would only map the shared zero page and the first write in a timed region would copy it.
+ */
+void *touch_pages(void* arguments){
+    struct touch_args_t *args = (struct touch_args_t *)arguments;
+    for(uint64_t i = 0; i < args->size; i += 0x1000){
+        ((volatile uint8_t*) args->start)[i] = 1;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Faults in the whole candidate pool with PREFAULT_THREADS threads and locks it in memory, 
+ * so no page fault happens within the timed Write+Write measurements.
+ */
+void prefault_candidate_pool(struct candidate_pool_t* pool){
+    pthread_t threads[PREFAULT_THREADS];
+    struct touch_args_t args[PREFAULT_THREADS];
+
+    // Split the pool in page aligned slices
+    uint64_t slice = ((pool->size / PREFAULT_THREADS) + pool->page_size - 1) & ~(pool->page_size - 1);
+    int threads_started = 0;
+    for(int t = 0; t < PREFAULT_THREADS && t * slice < pool->size; t++){
+        args[t].start = (uint8_t*) pool->base + t * slice;
+        args[t].size = pool->size - t * slice < slice ? pool->size - t * slice : slice;
+        if(pthread_create(&threads[t], NULL, touch_pages, &args[t]) != 0){
+            touch_pages(&args[t]);
+            continue;
+        }
+        threads_started |= 1 << t;
+    }
+    for(int t = 0; t < PREFAULT_THREADS; t++){
+        if(threads_started & (1 << t)){
+            pthread_join(threads[t], NULL);
+        }
+    }
+    if(mlock(pool->base, pool->size) != 0){
+        printf("Could not lock the candidate pool, check ulimit -l\n");
+    }
+}
+#endif // PREFAULT_POOL
+
+/**
+ * @brief Finds the set index bits of the victim that lie above the page offset. The pool must be backed by 
+ * huge pages: we classify the line at the victim's page offset in every 4 KiB page of a set index period 
+ * and count the collisions per period offset. The line with the victim's set index only collides if it is 
+ * also in the victim's slice, so we go on over the following periods until one offset has SET_OFFSET_MARGIN 
+ * collisions more than any other.
+ * 
+ * @param offset -> returns the offset of the victim's set index within a period
+ * @return false if no offset stands out in the whole pool
+ */
+bool find_victim_set_offset(struct candidate_pool_t* pool, uint64_t* victim, uint64_t period, uint64_t* offset){
+    uint64_t victim_offset = (uint64_t) victim & 0xFC0;
+    uint8_t *base = (uint8_t*) pool->base;
+    int hits[period / 0x1000];
+    double mean[2];
+
+    for(uint64_t j = 0; j < period / 0x1000; j++){
+        hits[j] = 0;
+    }
+    outlier_stats.scan_outliers = 0;
+    for(uint64_t p = 0; p + period <= pool->size; p += period){
+        for(uint64_t j = 0; j < period / 0x1000; j++){
+            void* candidate = base + p + j*0x1000 + victim_offset;
+            if(classify_pair(victim, candidate, get_control_address(candidate), mean) == COLLISION_0){
+                hits[j]++;
+            }
+        }
+        // Leading offset and runner-up
+        uint64_t best = 0;
+        int second = 0;
+        for(uint64_t j = 1; j < period / 0x1000; j++){
+            if(hits[j] > hits[best]){
+                second = hits[best];
+                best = j;
+            }else if(hits[j] > second){
+                second = hits[j];
+            }
+        }
+        if(hits[best] - second >= SET_OFFSET_MARGIN){
+            *offset = best*0x1000 + victim_offset;
+            return true;
+        }
+    }
+    return false;
+}
 
-    // Initialize the eviction set list.
-    struct eviction_set_t *ev_set = malloc(sizeof(struct eviction_set_t));
-    struct eviction_set_t *current = ev_set;
+/**
+ * @brief Initializes the candidate pool. With 4 KiB pages, every page provides one candidate: the line 
+ * at the victim's page offset. With huge pages, we know all set index bits of the pool. Only the lines 
+ * that match the victim's full set index are candidates, i.e., one line per period of the LLC set mask. 
+ * If the victim's set index bits cannot be found, huge pages are scanned like 4 KiB pages.
+ */
+void init_candidate_pool(struct candidate_pool_t* pool, uint64_t* victim){
+    uint64_t start = (uint64_t) pool->base;
+    uint64_t end = start + pool->size;
+    uint64_t offset;
+    bool found = false;
 
-    // Get the set bits that are controlled by the virtual address
-    uint64_t victim_set = (uint64_t) victim & 0xFC0;
-    uint64_t addr_space_set = (uint64_t) addr_space & 0xFC0;
+    if(pool->page_size == HUGE_PAGE_SIZE){
+        // The set index period, at most one huge page
+        uint64_t period = (llc.set_mask | 0xFFF) + 1;
+        if(period > HUGE_PAGE_SIZE){
+            period = HUGE_PAGE_SIZE;
+        }
+        found = find_victim_set_offset(pool, victim, period, &offset);
+        if(found){
+            if(verbose){
+                printf("Victim set offset: 0x%lx\n", offset);
+            }
+            pool->first = (uint8_t*) (start + offset);
+            pool->stride = period;
+            pool->count = (end - start) / period;
+        }else if(verbose){
+            printf("No victim set offset stands out, scanning one line per 4 KiB page\n");
+        }
+    }
+    if(!found){
+        // Get the set bits that are controlled by the virtual address
+        uint64_t victim_set = (uint64_t) victim & 0xFC0;
+        uint64_t first_page = (start + 0xFFF) & 0xFFFFFFFFFFFFF000;
+        uint64_t end_page = end & 0xFFFFFFFFFFFFF000;
 
-    // Make sure the start address is within the allocated array.
-    uint64_t *start_address;
-    if (addr_space_set < victim_set){
-        addr_space += victim_set;
+        // Align the lower 12 bits of the victim and the candidate addresses
+        pool->first = (uint8_t*) (first_page | victim_set);
+        pool->stride = 0x1000;
+        pool->count = end_page > first_page ? (end_page - first_page) / pool->stride : 0;
     }
 
-    // Align the lower 12 bits of the victim and the candidate addresses, ignore the offset
-    start_address = (uint64_t*) (((uint64_t)addr_space & 0xFFFFFFFFFFFFF000 ) | victim_set);
+    #ifdef SPARSE_POOL
+    pool->page_state = calloc(pool->size / pool->page_size + 1, sizeof(*pool->page_state));
+    pool->keep_first = 0;
+    pool->keep_count = 0;
+    pool->released_pages = 0;
+    #endif // SPARSE_POOL
+}
+
+/**
+ * @brief Returns a control address for the reference-controlled classification. The control address lies 
+ * in the page of the candidate but at a different page offset, so it can never share a cache set with the victim.
+ */
+void* get_control_address(void* candidate){
+    return (void*) ((uint64_t) candidate ^ 0x800);
+}
+
+/**
+ * @brief Classifies the candidates [first, first+count) of the pool and returns the colliding ones.
+ * 
+ * @param list -> if not NULL, the candidates [first, first+count) of this list are classified instead. 
+ * The control addresses are then taken from the first candidates of the pool.
+ */
+struct eviction_set_t* get_evset(struct candidate_pool_t* pool, uint64_t* victim, void** list, uint64_t first, uint64_t count){ 
+    
+    int success_ctr = 0;
+    #if defined(USE_LIBTEA) || defined(GROUP_TESTING)
+    int failure_ctr = 0;
+    #endif
+    #if defined(GROUP_TESTING) || defined(REFERENCE_CONTROL) || defined(SPARSE_POOL)
+    // Candidates whose pages host the control addresses
+    uint64_t control_first = list ? 0 : first;
+    #endif
+    #ifdef GROUP_TESTING
+    uint64_t control_count = list ? pool->count : count;
+    #endif // GROUP_TESTING
+
+    // Initialize the eviction set.
+    struct eviction_set_t *ev_set = new_evset(EVSET_INITIAL_CAPACITY);
+
+    uint64_t end = first + count;
 
     #ifndef BENCH 
-    printf("%p\n%p\n", (void*) victim, (void*) start_address);
+    printf("%p\n%p\n", (void*) victim, scan_candidate(pool, list, first));
+    #endif
+
+    #ifndef TRY_UNTIL_SUCCESS
+    clock_t before = clock();
+    uint64_t measurements_before = measurement_ctr;
+    uint64_t faults_before = get_page_faults();
+    uint64_t candidate_ctr = 0;
+    #endif //TRY_UNTIL_SUCCESS
+
+    // Pairs that exceed the outlier budget are measured again once at the end of the scan
+    outlier_stats.scan_outliers = 0;
+    struct candidate_queue_t requeue;
+    requeue.candidates = malloc((count + 1) * sizeof(void*));
+    requeue.len = 0;
+
+    #ifdef SPARSE_POOL
+    // The pages of the first candidates host the control addresses
+    pool->keep_first = control_first;
+    #if defined(GROUP_TESTING)
+    pool->keep_count = control_count < group_size ? control_count : group_size;
+    #elif defined(REFERENCE_CONTROL)
+    pool->keep_count = 1;
     #endif
+    prefault_candidates(pool, pool->keep_first, pool->keep_count);
+    #endif // SPARSE_POOL
 
+    #ifdef GROUP_TESTING
+    // Group of group_size candidates, measured against as many control addresses in different pages
+    void* group[GROUP_SIZE_MAX];
+    void* controls[GROUP_SIZE_MAX];
+    for(int j = 0; j < group_size && (uint64_t) j < control_count; j++){
+        controls[j] = get_control_address(get_candidate(pool, control_first+j));
+    }
+    for(uint64_t c = first; c < end; c += group_size){
+        if(scan_over_deadline(get_evset_len(ev_set))){
+            break;
+        }
+        int k = end - c < (uint64_t) group_size ? (int) (end - c) : group_size;
+        for(int j = 0; j < k; j++){
+            group[j] = scan_candidate(pool, list, c+j);
+        }
+        #ifdef SPARSE_POOL
+        prefault_scan(pool, list, c, k);
+        #endif // SPARSE_POOL
+        group_test(pool, victim, group, controls, k, ev_set, &requeue, &success_ctr, &failure_ctr);
+        #ifndef TRY_UNTIL_SUCCESS
+        candidate_ctr += k;
+        #endif //TRY_UNTIL_SUCCESS
+    }
+    // Second chance for the re-queued candidates, these are dropped if they exceed the budget again
+    for(uint64_t c = 0; c < requeue.len; c += group_size){
+        int k = requeue.len - c < (uint64_t) group_size ? (int) (requeue.len - c) : group_size;
+        group_test(pool, victim, &requeue.candidates[c], controls, k, ev_set, NULL, &success_ctr, &failure_ctr);
+    }
+    #else
     // Some variables for the main loop
-    int ctr;
+    int result;
     double mean[2] = {0, 0};
     void* candidate_0;
     void* candidate_1;
 
-    #ifndef TRY_UNTIL_SUCCESS
-    clock_t before = clock();
-    #endif //TRY_UNTIL_SUCCESS
-    // Main loop
-    for (uint64_t i = 0; i < addr_space_size-2*0x1000; i+=2*0x1000)
-    {
-        ctr = 0;
-        // Set the candidate addresses
-        candidate_0 = (void*) &(start_address[i]);
-        candidate_1 = (void*) &(start_address[i+0x1000]);
+    #ifdef REFERENCE_CONTROL
+    // Every measurement pairs a single candidate with the non-colliding control address
+    void* control = get_control_address(get_candidate(pool, control_first));
+    uint64_t step = 1;
+    #else
+    uint64_t step = 2;
+    #endif // REFERENCE_CONTROL
 
-        while((ctr) != 2*RUNS){
-            decision = (ctr & 0x2) >> 1;
-            
-            retry: 
-            asm volatile(
-                "cpuid\n\t"                         // Clear all active instructions before we start. This is not strictly required
-                "clflush (%[victim])\n\t"           // Flush the victim address
-                "test %[decision], %[decision]\n\t" // test if decision = 0
-                "lea (%[candidate_0]), %%rax\n\t"   // rax = *candidate0
-                "lea (%[candidate_1]), %%rbx\n\t"   // rbx = *candidate1
-                "cmove %%rax, %%rcx\n\t"            // conditional move -> if decision == 1, rcx=rax
-                "cmovne %%rbx, %%rcx\n\t"           // else -> rcx = rbx
-                "movq %%rax, (%%rcx)\n\t"           // write to rcx
-                "mfence\n\t"                    
-                "cpuid\n\t"                         // serialization
-                "nop\n\t"                           // alignment
-                "nop\n\t"
-                "nop\n\t"                           // We found that this reduces the number of outliers in the measurements
-                "nop\n\t"                           // but it also works without...
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "rdtscp\n\t"                        // start the timing
-                "shl $32, %%rdx\n\t"                // combine the timestamp
-                "or %%rdx, %%rax\n\t"
-                "mov %%rax, %%r15\n\t"              // move timestamp out of the way
-                "movq %%rdx, (%[victim])\n\t"       // write to the victim address
-                "mfence\n\t"
-                "cpuid\n\t"                         // serialization
-                "nop\n\t"                           // nops for imporved stability of timing measurement
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "nop\n\t"
-                "rdtscp\n\t"                        // get the timestamp
-                "shl $32, %%rdx\n\t"                // combine it
-                "or %%rdx, %%rax\n\t"
-                "sub %%r15, %%rax\n\t"              // compute the difference from the first timestamp
-                "mov %%rax, %[out]\n\t"
-                : [out]"=r"(time) : [decision]"r"(decision), [candidate_0]"r"(candidate_0), [candidate_1]"r"(candidate_1), [victim]"r"(victim) : "rax", "rbx", "rcx", "rdx", "r15"
-            );
-
-
-            if(time > OUTLIER_THRESHOLD){ // OUTLIER_THRESHOLD is kinda important in finetuning the evset construction. Ideal value depends on the CPU.
-                goto retry; // sorry... ¯\_('_')_/¯
-            }
-            // Store the measured time
-            mean[decision] += time;
-            ctr++;
-            
-        }  
-        // Compute the means
-        mean[0] /= RUNS;
-        mean[1] /= RUNS;
+    // Main loop, first over the candidates, then over the re-queued ones
+    uint64_t i = first;
+    uint64_t requeue_pos = 0;
+    while(true)
+    {
+        bool retry = false;
+        if(scan_over_deadline(get_evset_len(ev_set))){
+            break;
+        }
+        if(i + step <= end){
+            // Set the candidate addresses
+            candidate_0 = scan_candidate(pool, list, i);
+            #ifdef REFERENCE_CONTROL
+            candidate_1 = control;
+            #else
+            candidate_1 = scan_candidate(pool, list, i+1);
+            #endif // REFERENCE_CONTROL
 
-        // Check if we have a significant difference in means.
-        if(fabs(mean[0]-mean[1]) > 10){
-            #ifdef USE_LIBTEA 
-            size_t vpaddr = libtea_get_physical_address(instance, (size_t)victim);
-            size_t paddr = libtea_get_physical_address(instance, (size_t)candidate_0);
-            size_t paddr2 = libtea_get_physical_address(instance, (size_t)candidate_1);
-            int victim_set = libtea_get_cache_set(instance, vpaddr);
-            int candidate_0_set = libtea_get_cache_set(instance, paddr);
-            int candidate_1_set = libtea_get_cache_set(instance, paddr2);
+            #ifdef SPARSE_POOL
+            prefault_scan(pool, list, i, step);
+            #endif // SPARSE_POOL
+            i += step;
+        }else if(requeue_pos + step <= requeue.len){
+            // The pages of re-queued candidates are still resident
+            candidate_0 = requeue.candidates[requeue_pos];
+            #ifdef REFERENCE_CONTROL
+            candidate_1 = control;
+            #else
+            candidate_1 = requeue.candidates[requeue_pos+1];
+            #endif // REFERENCE_CONTROL
+            requeue_pos += step;
+            retry = true;
+        }else{
+            break;
+        }
+        result = classify_pair(victim, candidate_0, candidate_1, mean);
+        if(result == PAIR_SKIPPED){
+            if(!retry){
+                requeue.candidates[requeue.len++] = candidate_0;
+                if(step == 2){
+                    requeue.candidates[requeue.len++] = candidate_1;
+                }
+                continue;
+            }
+            // Give up on the pair
+            outlier_stats.dropped += step;
+            result = NO_COLLISION;
+        }
+        #ifdef REFERENCE_CONTROL
+        // The control address cannot collide, a slower control write is noise
+        if(result == COLLISION_1){
+            result = NO_COLLISION;
+        }
+        #endif // REFERENCE_CONTROL
+        #ifndef TRY_UNTIL_SUCCESS
+        candidate_ctr += step;
+        #endif //TRY_UNTIL_SUCCESS
+        #ifdef SPARSE_POOL
+        // Keep the pages of colliding candidates, return the others to the kernel
+        if(result == COLLISION_0){
+            pin_candidate(pool, candidate_0);
+        }else{
+            release_candidate(pool, candidate_0);
+        }
+        #ifndef REFERENCE_CONTROL
+        if(result == COLLISION_1){
+            pin_candidate(pool, candidate_1);
+        }else{
+            release_candidate(pool, candidate_1);
+        }
+        #endif // REFERENCE_CONTROL
+        #endif // SPARSE_POOL
+
+        // Check if we have a significant difference in means.
+        if(result != NO_COLLISION){
+            #ifdef USE_LIBTEA 
+            size_t vpaddr = libtea_get_physical_address(instance, (size_t)victim);
+            size_t paddr = libtea_get_physical_address(instance, (size_t)candidate_0);
+            size_t paddr2 = libtea_get_physical_address(instance, (size_t)candidate_1);
+            int victim_set = libtea_get_cache_set(instance, vpaddr);
+            int candidate_0_set = libtea_get_cache_set(instance, paddr);
+            int candidate_1_set = libtea_get_cache_set(instance, paddr2);
             int victim_slice = libtea_get_cache_slice(instance, vpaddr);
             int candidate_0_slice = libtea_get_cache_slice(instance, paddr);
             int candidate_1_slice = libtea_get_cache_slice(instance, paddr2);
@@ -139,7 +1011,7 @@ struct eviction_set_t* get_evset(uint64_t* addr_space, uint64_t* victim, uint64_
             success_ctr++;
             #endif // USE LIBTEA
             // If the difference is positive, candidate 0 collides
-            if (mean[0]-mean[1] > 0) {
+            if (result == COLLISION_0) {
                 #ifdef USE_LIBTEA
                 if (victim_set == candidate_0_set){
                     success_ctr++;
@@ -158,10 +1030,8 @@ struct eviction_set_t* get_evset(uint64_t* addr_space, uint64_t* victim, uint64_
                     #endif
                 }
                 #endif
-                // Add the address to the eviction set list.
-                current->address = candidate_0;
-                current->next = (struct eviction_set_t*) malloc(sizeof(struct eviction_set_t));
-                current = current->next;
+                // Add the address to the eviction set.
+                append_evset_address(ev_set, candidate_0);
             }else{ // Mean is negative --> candidate 1 collides
                 #ifdef USE_LIBTEA
                 if (victim_set == candidate_1_set){
@@ -180,9 +1050,7 @@ struct eviction_set_t* get_evset(uint64_t* addr_space, uint64_t* victim, uint64_
                 }
                 #endif
                 // Add the address to the eviction set.
-                current->address = candidate_1;
-                current->next = (struct eviction_set_t*) malloc(sizeof(struct eviction_set_t));
-                current = current->next;
+                append_evset_address(ev_set, candidate_1);
             }
             #ifndef BENCH
             printf("Victim:\t \t%p\nCandidate1:\t%p\nCandidate2:\t%p\n", (void*) victim, candidate_0, candidate_1);
@@ -194,409 +1062,2327 @@ struct eviction_set_t* get_evset(uint64_t* addr_space, uint64_t* victim, uint64_
             printf("Means: Group 0: %6.6f, Group 1: %6.6f, Diff: %6.6f\n", mean[0], mean[1], mean[1]-mean[0]);
             #endif // BENCH
         }
-        
+        
+    }
+    #endif // GROUP_TESTING
+    free(requeue.candidates);
+    #ifdef SPARSE_POOL
+    release_kept_candidates(pool);
+    #endif // SPARSE_POOL
+    #ifndef TRY_UNTIL_SUCCESS
+    if(!verbose){
+        return ev_set;
+    }
+    // Print timing stats.
+    clock_t difference = clock() - before;
+    printf("############\n\n");
+    long msec = difference * 1000 / CLOCKS_PER_SEC;
+    printf("Time taken %ld seconds %ld milliseconds\n",
+        msec/1000, msec%1000);
+    printf("Measurements: %lu, %.1f per candidate\n", measurement_ctr - measurements_before, 
+        (measurement_ctr - measurements_before) / (double) candidate_ctr);
+    printf("Page faults: %lu\n", get_page_faults() - faults_before);
+    print_outlier_stats();
+
+    #ifdef USE_LIBTEA
+    printf("\nResult: %d matches, thereof %d false positives.\n\n", success_ctr+failure_ctr, failure_ctr);
+    #else
+    printf("\nResult: %d matches.\n\n", success_ctr);
+    #endif
+    #endif // TRY_UNTIL_SUCCESS
+    return ev_set;
+}
+
+#ifdef CLASSIFY_BENCH
+/**
+ * @brief Compares the pairwise and the reference-controlled classification on the same candidates, each with 
+ * the fixed sample test and the SPRT, and prints the number of candidates classified per second. For both 
+ * schemes, the speedup of the SPRT in measurements and candidates per second is printed as well.
+ */
+void bench_classification(struct candidate_pool_t* pool, uint64_t* victim){
+    static int (*const tests[2])(uint64_t*, void**, void**, int, double*) = {classify_groups_fixed, classify_groups_sprt};
+    void* control = get_control_address(get_candidate(pool, 0));
+    uint64_t candidates = pool->count;
+    double mean[2];
+
+    for(int scheme = 0; scheme < 2; scheme++){
+        double per_candidate[2], rate[2];
+        for(int test = 0; test < 2; test++){
+            int collisions = 0;
+            uint64_t measurements_before = measurement_ctr;
+            outlier_stats.scan_outliers = 0;
+            clock_t before = clock();
+            if(scheme == 0){
+                // Pairwise: candidate i against candidate i+1
+                for(uint64_t c = 0; c + 1 < candidates; c += 2){
+                    void* candidate_0 = get_candidate(pool, c);
+                    void* candidate_1 = get_candidate(pool, c+1);
+                    int result = tests[test](victim, &candidate_0, &candidate_1, 1, mean);
+                    if(result == COLLISION_0 || result == COLLISION_1){
+                        collisions++;
+                    }
+                }
+            }else{
+                // Reference-controlled: every candidate against the control address
+                for(uint64_t c = 0; c < candidates; c++){
+                    void* candidate = get_candidate(pool, c);
+                    if(tests[test](victim, &candidate, &control, 1, mean) == COLLISION_0){
+                        collisions++;
+                    }
+                }
+            }
+            clock_t difference = clock() - before;
+            double sec = difference / (double) CLOCKS_PER_SEC;
+            per_candidate[test] = (measurement_ctr - measurements_before) / (double) candidates;
+            rate[test] = candidates / sec;
+            printf("%-10s %-6s %lu candidates, %d collisions, %.1f measurements per candidate, %.3f s, %.0f candidates/s\n", 
+                scheme == 0 ? "Pairwise:" : "Reference:", test == 0 ? "fixed" : "SPRT", candidates, collisions, 
+                per_candidate[test], sec, rate[test]);
+        }
+        printf("%-10s SPRT speedup %.2fx in measurements per candidate, %.2fx in candidates/s\n", scheme == 0 ? "Pairwise:" : "Reference:",
+            per_candidate[0] / per_candidate[1], rate[1] / rate[0]);
+    }
+}
+#endif // CLASSIFY_BENCH
+
+/**
+ * @brief Returns the CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t now_ns(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/**
+ * @brief Returns true if a deadline was set (-d) and it passed.
+ */
+bool deadline_passed(){
+    return deadline_ns != 0 && now_ns() >= deadline_ns;
+}
+
+/**
+ * @brief Measures the time of test_evset per eviction set address, on lines of a scratch buffer at the victim's page offset.
+ */
+void calibrate_test_cost(uint64_t* victim){
+    uint8_t *buffer = malloc((EVSET_INITIAL_CAPACITY + 1) * 0x1000);
+    struct eviction_set_t *ev_set = new_evset(EVSET_INITIAL_CAPACITY);
+    uint8_t *page = (uint8_t*)(((uint64_t) buffer + 0xFFF) & ~0xFFFULL);
+    // Back the buffer with its own pages, untouched pages all map the shared zero page
+    memset(buffer, 0, (EVSET_INITIAL_CAPACITY + 1) * 0x1000);
+    for(int i = 0; i < EVSET_INITIAL_CAPACITY; i++){
+        append_evset_address(ev_set, (uint64_t*)(page + i*0x1000 + ((uint64_t) victim & 0xFC0)));
+    }
+    uint64_t tests_before = test_ctr;
+    uint64_t inconclusive_before = inconclusive_ctr;
+    uint64_t start = now_ns();
+    for(int r = 0; r < DEADLINE_CALIBRATION_TESTS; r++){
+        vote_evset(victim, ev_set);
+    }
+    test_ns_per_address = (now_ns() - start) / (double) (DEADLINE_CALIBRATION_TESTS * EVSET_INITIAL_CAPACITY);
+    test_ctr = tests_before;
+    inconclusive_ctr = inconclusive_before;
+    free(buffer);
+    printf("test_evset: %.1f ns per address\n", test_ns_per_address);
+}
+
+/**
+ * @brief Estimates the time to reduce a set of len addresses. Every round tests on average half of the 
+ * w+1 groups and shrinks the set by 1/(w+1), so the tested addresses sum up to about len * (w+1)^2 / 2.
+ */
+uint64_t estimate_reduction_ns(int len){
+    return test_ns_per_address * len * (llc.assoc + 1) * (llc.assoc + 1) / 2;
+}
+
+/**
+ * @brief Returns true if the scan has to stop so the reduction of the found addresses still fits the deadline.
+ */
+bool scan_over_deadline(int found){
+    if(deadline_ns == 0){
+        return false;
+    }
+    uint64_t now = now_ns();
+    // Without an eviction set, scanning until the deadline is the only option
+    if(found <= llc.assoc){
+        return now >= deadline_ns;
+    }
+    return now + estimate_reduction_ns(found) >= deadline_ns;
+}
+
+/**
+ * @brief Group testing over the addresses from index fixed on: splits them into w+1 groups and drops 
+ * the first group without which the set still evicts the victim. Stops when the set has length w, 
+ * no address from fixed on is left, or no group could be removed max_failures times.
+ * 
+ * @param group -> scratch space for (len - fixed) / (w+1) + 1 addresses
+ */
+static void reduce_groups(uint64_t *victim, struct eviction_set_t *ev_set, int fixed, int max_failures, uint64_t **group){
+    int abort_ctr = 0;
+    while(ev_set->len > llc.assoc && ev_set->len > fixed){
+        // Out of time, the set still evicts the victim
+        if(deadline_passed()){
+            return;
+        }
+        int len = ev_set->len;
+        int groups = len - fixed < llc.assoc + 1 ? len - fixed : llc.assoc + 1;
+        bool removed = false;
+        for(int i = 0; i < groups; i++){
+            // Every failed test rotates its group to the end, so the next untested group always starts at fixed.
+            // After a round without removal the set is back in its original order.
+            int first = fixed;
+            int size = (int)((int64_t)(len - fixed) * (i+1) / groups) - (int)((int64_t)(len - fixed) * i / groups);
+
+            // Move the group to the end of the set and test the set without it.
+            memcpy(group, &ev_set->address[first], size * sizeof(uint64_t*));
+            memmove(&ev_set->address[first], &ev_set->address[first + size], (len - first - size) * sizeof(uint64_t*));
+            memcpy(&ev_set->address[len - size], group, size * sizeof(uint64_t*));
+            ev_set->len = len - size;
+            // An inconclusive vote keeps the group, it is tested again in the next round.
+            if(vote_evset(victim, ev_set) == EVSET_EVICTS){
+                removed = true;
+                break;
+            }
+            ev_set->len = len;
+        }
+        // No group could be removed, either a measurement was wrong or the set does not evict the victim anymore.
+        if(!removed && ++abort_ctr >= max_failures){
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Returns true if the ev_set was successfully reduced to a minimal ev-set.
+ * Splits the set into w+1 groups (w = llc.assoc) and drops the first group without which the set still evicts 
+ * the victim. One of the groups contains no congruent address, so every round shrinks the set by about 
+ * 1/(w+1). Needs O(w^2 * n) memory accesses and no recursion.
+ * If the first addresses were reduced before, only the addresses appended since are reduced first, 
+ * the whole set is only reduced if that does not give a minimal ev-set.
+ * 
+ * @param victim -> the victim address
+ * @param ev_set -> the eviction set, reduced in place
+ * @param reduced -> the number of addresses at the start of the set that were reduced before
+ * @return true if successful
+ * @return false else
+ */
+bool reduce_evset(uint64_t *victim, struct eviction_set_t *ev_set, int reduced){
+    struct timespec start, end;
+    uint64_t tests_before = test_ctr;
+    uint64_t inconclusive_before = inconclusive_ctr;
+    bool success = false;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Scratch space for moving a group to the end of the set
+    uint64_t **group = arena_alloc((ev_set->len / (llc.assoc + 1) + 1) * sizeof(uint64_t*));
+
+    // Check whether the initial eviction set is functional, if not return false
+    if(test_evset(victim, ev_set) == false){
+        goto out;
+    }
+    if(reduced > 0 && reduced < ev_set->len){
+        // Test the new addresses against the reduced ones. These only keep the congruent new addresses.
+        reduce_groups(victim, ev_set, reduced, 2, group);
+    }
+    // If this fails w times, chances are that something went wrong...
+    reduce_groups(victim, ev_set, 0, llc.assoc+2, group);
+
+    // The eviction set has length w, we do a double check whether it actually works...
+    success = ev_set->len == llc.assoc && test_evset(victim, ev_set);
+
+out:
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+    if(verbose){
+        printf("Reduction: %lu test_evset calls (%lu inconclusive), %ld.%03ld milliseconds\n", test_ctr - tests_before, 
+            inconclusive_ctr - inconclusive_before, usec/1000, usec%1000);
+    }
+    return success;
+}
+
+/**
+ * @brief Allocates size bytes from the eviction set arena. Allocations are cache line aligned 
+ * and only freed all at once by reset_evset_arena.
+ */
+void* arena_alloc(uint64_t size){
+    if(evset_arena.base == NULL){
+        evset_arena.base = mmap(NULL, EVSET_ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(evset_arena.base == MAP_FAILED){
+            printf("Could not allocate the eviction set arena\n");
+            exit(1);
+        }
+        evset_arena.size = EVSET_ARENA_SIZE;
+        evset_arena.used = 0;
+    }
+    size = (size + 63) & ~63ULL;
+    if(evset_arena.used + size > evset_arena.size){
+        printf("Eviction set arena exhausted, increase EVSET_ARENA_SIZE\n");
+        exit(1);
+    }
+    void* p = evset_arena.base + evset_arena.used;
+    evset_arena.used += size;
+    return p;
+}
+
+/**
+ * @brief Frees all eviction sets at once.
+ */
+void reset_evset_arena(){
+    evset_arena.used = 0;
+}
+
+/**
+ * @brief Unmaps the eviction set arena of the calling thread.
+ */
+void free_evset_arena(){
+    if(evset_arena.base != NULL){
+        munmap(evset_arena.base, evset_arena.size);
+        evset_arena.base = NULL;
+    }
+}
+
+/**
+ * @brief Returns an empty eviction set with room for capacity addresses.
+ */
+struct eviction_set_t* new_evset(int capacity){
+    struct eviction_set_t *ev_set = arena_alloc(sizeof(struct eviction_set_t));
+    ev_set->address = arena_alloc(capacity * sizeof(uint64_t*));
+    ev_set->len = 0;
+    ev_set->capacity = capacity;
+    return ev_set;
+}
+
+/**
+ * @brief Makes room for at least capacity addresses. The old array is left in the arena.
+ */
+static void reserve_evset(struct eviction_set_t* ev_set, int capacity){
+    if(capacity <= ev_set->capacity){
+        return;
+    }
+    int new_capacity = ev_set->capacity * 2 > capacity ? ev_set->capacity * 2 : capacity;
+    uint64_t **address = arena_alloc(new_capacity * sizeof(uint64_t*));
+    memcpy(address, ev_set->address, ev_set->len * sizeof(uint64_t*));
+    ev_set->address = address;
+    ev_set->capacity = new_capacity;
+}
+
+/**
+ * @brief Appends an address to the eviction set.
+ */
+void append_evset_address(struct eviction_set_t* ev_set, uint64_t* address){
+    if(ev_set->len == ev_set->capacity){
+        reserve_evset(ev_set, ev_set->len + 1);
+    }
+    ev_set->address[ev_set->len++] = address;
+}
+
+/**
+ * @brief Appends the addresses of b to a. If a is NULL, a becomes b.
+ */
+void merge_evsets(struct eviction_set_t** a, struct eviction_set_t** b){
+    if(*a == NULL){
+        *a = *b;
+        return;
+    }
+    reserve_evset(*a, (*a)->len + (*b)->len);
+    memcpy(&(*a)->address[(*a)->len], (*b)->address, (*b)->len * sizeof(uint64_t*));
+    (*a)->len += (*b)->len;
+}
+
+/**
+ * @brief Get the length of the eviction set
+ */
+int get_evset_len(struct eviction_set_t* ev_set){
+    return ev_set->len;
+}
+
+#ifdef POINTER_CHASE
+/**
+ * @brief Threads the eviction set through its lines: every line stores the address of the next one, 
+ * the last one stores NULL.
+ */
+void link_evset(struct eviction_set_t* ev_set){
+    for(int i = 0; i + 1 < ev_set->len; i++){
+        *(uint64_t**)ev_set->address[i] = ev_set->address[i+1];
+    }
+    if(ev_set->len > 0){
+        *(uint64_t**)ev_set->address[ev_set->len-1] = NULL;
+    }
+}
+#endif // POINTER_CHASE
+
+/**
+ * @brief Defines the kernel that returns the access time of a load from address, TIMESTAMP reads the timer into rax.
+ */
+#define TIME_LOAD_KERNEL(NAME, TIMESTAMP) \
+static inline uint64_t time_load_##NAME(uint64_t *address){ \
+    uint64_t t_probe; \
+    asm volatile( \
+        ".rept 16\n\tnop\n\t.endr\n\t"      /* alignment */ \
+        TIMESTAMP                           /* Start measurement */ \
+        "mov %%rax, %%r15\n\t"              /* Move the timestamp out of the way */ \
+        "movq (%[victim]), %%rdx\n\t"       /* Access the victim address */ \
+        "mfence\n\t"                        /* Make sure the timestamp isn't taken out of order */ \
+        ".rept 11\n\tnop\n\t.endr\n\t"      /* Nops for improved accuracy */ \
+        TIMESTAMP                           /* End the timing measurement */ \
+        "sub %%r15, %%rax\n\t"              /* Compute the difference */ \
+        "mov %%rax, %[out]" \
+    : [out]"=r"(t_probe) : [victim]"r"(address) : "rax", "rbx", "rcx", "rdx", "r15"); \
+    return t_probe; \
+}
+
+/**
+ * @brief Defines the empty load kernel: the timed region of time_load without the load.
+ */
+#define TIME_LOAD_OVERHEAD_KERNEL(NAME, TIMESTAMP) \
+static inline uint64_t time_load_overhead_##NAME(){ \
+    uint64_t t_probe; \
+    asm volatile( \
+        ".rept 16\n\tnop\n\t.endr\n\t" \
+        TIMESTAMP                           /* Start measurement */ \
+        "mov %%rax, %%r15\n\t"              /* Move the timestamp out of the way */ \
+        "mfence\n\t" \
+        ".rept 11\n\tnop\n\t.endr\n\t" \
+        TIMESTAMP                           /* End the timing measurement */ \
+        "sub %%r15, %%rax\n\t"              /* Compute the difference */ \
+        "mov %%rax, %[out]" \
+    : [out]"=r"(t_probe) : : "rax", "rbx", "rcx", "rdx", "r15"); \
+    return t_probe; \
+}
+
+TIME_LOAD_KERNEL(tsc, TIMESTAMP_TSC_ASM)
+TIME_LOAD_KERNEL(counter, TIMESTAMP_COUNTER_ASM)
+TIME_LOAD_OVERHEAD_KERNEL(tsc, TIMESTAMP_TSC_ASM)
+TIME_LOAD_OVERHEAD_KERNEL(counter, TIMESTAMP_COUNTER_ASM)
+
+/**
+ * @brief Returns the access time of a load from address with the selected timer.
+ */
+static inline uint64_t time_load(uint64_t *address){
+    return timer == TIMER_COUNTING_THREAD ? time_load_counter(address) : time_load_tsc(address);
+}
+
+/**
+ * @brief Returns the timer overhead of time_load.
+ */
+static inline uint64_t time_load_overhead(){
+    return timer == TIMER_COUNTING_THREAD ? time_load_overhead_counter() : time_load_overhead_tsc();
+}
+
+/**
+ * @brief Accesses the victim, then the eviction set, and returns the access time of the victim.
+ */
+static inline uint64_t probe_evset(uint64_t *victim, struct eviction_set_t *ev_set){
+    // Access the victim address
+    asm volatile("movq (%0), %%rax\n" : : "r"(victim) : "rax");
+
+    #ifdef POINTER_CHASE
+    // Chase the pointers through the eviction set twice, this only touches the eviction set lines
+    if(ev_set->len > 0){
+        asm volatile(
+            "mov %[head], %%rax\n\t"
+            "1:\n\t"
+            "movq (%%rax), %%rax\n\t"
+            "test %%rax, %%rax\n\t"
+            "jnz 1b\n\t"
+            "mov %[head], %%rax\n\t"
+            "2:\n\t"
+            "movq (%%rax), %%rax\n\t"
+            "test %%rax, %%rax\n\t"
+            "jnz 2b\n\t"
+            : : [head] "r"(ev_set->address[0]) : "rax", "memory");
+    }
+    #else
+    // We access the eviction set addresses multiple times to make sure that they really are cached
+    uint64_t **address = ev_set->address;
+    for(int i = 0; i < ev_set->len; i++){
+        // Access the current and the previous ev-address
+        asm volatile("movq (%0), %%rax\n" : : "r"(address[i]) : "rax");
+        asm volatile("movq (%0), %%rax\n" : : "r"(address[i > 0 ? i-1 : 0]) : "rax");
+    }
+    // Second iteration to REALLY make sure the victim was replaced if it collides...
+    for(int i = 0; i < ev_set->len; i++){
+        asm volatile("movq (%0), %%rax\n" : : "r"(address[i]) : "rax");
+    }
+    #endif // POINTER_CHASE
+
+    // Measure the access time to the victim
+    return time_load(victim);
+}
+
+/**
+ * @brief Tests whether the eviction set evicts the victim with a TEST_VOTES_NEEDED-of-TEST_VOTES vote. 
+ * Stops as soon as the majority is decided.
+ * 
+ * @return EVSET_EVICTS, EVSET_NO_EVICTION, or EVSET_INCONCLUSIVE if more than TEST_RETRIES samples were implausible
+ */
+int vote_evset(uint64_t *victim, struct eviction_set_t *ev_set){
+    int samples = 0;
+    int evicted = 0;
+    int retries = 0;
+    test_ctr++;
+    #ifdef POINTER_CHASE
+    // The set changes between tests during the reduction, so it is linked before every test
+    link_evset(ev_set);
+    #endif // POINTER_CHASE
+    while(samples < TEST_VOTES){
+        uint64_t t_probe = probe_evset(victim, ev_set);
+        // Filter measurements that are not plausible
+        if(t_probe < probe_min || t_probe > probe_max){
+            if(++retries > TEST_RETRIES){
+                inconclusive_ctr++;
+                return EVSET_INCONCLUSIVE;
+            }
+            continue;
+        }
+        samples++;
+        if (t_probe > cache_miss_threshold){ // very basic test of whether ev evicts the target.
+            evicted++;
+        }
+        if(evicted >= TEST_VOTES_NEEDED){
+            return EVSET_EVICTS;
+        }
+        if(evicted + (TEST_VOTES - samples) < TEST_VOTES_NEEDED){
+            return EVSET_NO_EVICTION;
+        }
+    }
+    return EVSET_NO_EVICTION;
+}
+
+/**
+ * @brief Returns true if the eviction set evicts the victim. Inconclusive votes count as failure.
+ */
+bool test_evset(uint64_t *victim, struct eviction_set_t *ev_set){
+    return vote_evset(victim, ev_set) == EVSET_EVICTS;
+}
+
+/**
+ * @brief Returns the fraction of EVICTION_RATE_PROBES plausible probes in which the eviction set evicts the victim.
+ */
+double eviction_rate(uint64_t* victim, struct eviction_set_t* ev_set){
+    int evicted = 0;
+    int samples = 0;
+    int retries = 0;
+    #ifdef POINTER_CHASE
+    link_evset(ev_set);
+    #endif // POINTER_CHASE
+    while(samples < EVICTION_RATE_PROBES && retries < EVICTION_RATE_PROBES * TEST_RETRIES){
+        uint64_t t_probe = probe_evset(victim, ev_set);
+        if(t_probe < probe_min || t_probe > probe_max){
+            retries++;
+            continue;
+        }
+        samples++;
+        if(t_probe > cache_miss_threshold){
+            evicted++;
+        }
+    }
+    return samples ? evicted / (double) samples : 0;
+}
+
+/**
+ * @brief Prints the best eviction set found before the deadline.
+ */
+void print_best_effort(uint64_t* victim, struct eviction_set_t* ev_set){
+    printf("Best effort eviction set: %d addresses, eviction rate %.1f%%\n", 
+        get_evset_len(ev_set), 100 * eviction_rate(victim, ev_set));
+}
+
+
+
+void print_evset(struct eviction_set_t* ev_set, uint64_t* victim){
+
+    printf("-----------  EV SET  -----------\n");
+
+    #if !defined(USE_LIBTEA) && !defined(VERIFY)
+    (void) victim;
+    #endif
+    #if defined(USE_LIBTEA) || defined(VERIFY)
+    size_t paddr = libtea_get_physical_address(instance, (size_t)victim);
+    int set = libtea_get_cache_set(instance, paddr);
+    int slice = libtea_get_cache_slice(instance, paddr);
+    printf("Victim: %p\t Cache Set: %4d, Cache Slice: %d\n\n", (void*) paddr, set, slice);
+    #endif
+
+
+    for(int i = 0; i < ev_set->len; i++){
+        #if defined(USE_LIBTEA) || defined(VERIFY)
+        paddr = libtea_get_physical_address(instance, (size_t)ev_set->address[i]);
+        set = libtea_get_cache_set(instance, paddr);
+        slice = libtea_get_cache_slice(instance, paddr);
+        printf("    %2d: %p\t Cache Set: %4d, Cache Slice: %d\n", i, (void*) paddr, set, slice);
+        #else
+        printf("    %2d: %p\n", i, ev_set->address[i]);
+        #endif
+    }
+}
+
+/**
+ * @brief Returns the value below which the given fraction of the samples lies.
+ */
+static uint64_t percentile(uint64_t* hist, uint64_t samples, double fraction){
+    uint64_t sum = 0;
+    for(uint64_t t = 0; t < CALIBRATION_MAX_CYCLES; t++){
+        sum += hist[t];
+        if(sum >= fraction * samples){
+            return t;
+        }
+    }
+    return CALIBRATION_MAX_CYCLES;
+}
+
+/**
+ * @brief Returns the overhead-corrected latency, the raw cycles minus the timer overhead.
+ */
+static inline uint64_t corrected(uint64_t cycles, uint64_t overhead){
+    return cycles > overhead ? cycles - overhead : 0;
+}
+
+static int compare_double(const void* a, const void* b){
+    double x = *(const double*) a, y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Returns the difference of the mean victim write times after writing candidate_0 and candidate_1, 
+ * measured like classify_groups with RUNS samples each. Samples above the outlier threshold are repeated.
+ */
+static double pair_difference(uint64_t* victim, void* candidate_0, void* candidate_1){
+    double mean[2] = {0, 0};
+    for(int ctr = 0; ctr != 2*RUNS; ctr++){
+        int decision = (ctr & 0x2) >> 1;
+        uint64_t time;
+        int retries = 0;
+        do{
+            time = measure_write(victim, candidate_0, candidate_1, decision);
+        }while(time > outlier_threshold && ++retries < PAIR_OUTLIER_BUDGET);
+        mean[decision] += time;
+    }
+    return (mean[0] - mean[1]) / RUNS;
+}
+
+/**
+ * @brief Calibrates the thresholds from the distributions of CALIBRATION_SAMPLES samples each. The timer 
+ * overhead is the median of the empty load and Write+Write kernels. The thresholds come from cached and 
+ * flushed loads of the victim, and Write+Write measurements of the victim with lines at the victim's page 
+ * offset in a scratch buffer. The cache miss threshold lies in the middle of the gap between the 99th percentile 
+ * of the hits and the 1st percentile of the misses, or if these overlap, in the middle of the valley of the load 
+ * histogram. If the modes cannot be separated, CACHE_MISS_THRESHOLD is kept. The outlier threshold is the 
+ * OUTLIER_PERCENTILE of the Write+Write samples, shifted by the collision effect so colliding writes are not 
+ * retried more often. With a colliding address, it is the larger of the percentiles of the scratch lines and of 
+ * the colliding address instead. With CORRECTED_THRESHOLDS, both thresholds are CORRECTED_MISS_THRESHOLD and 
+ * CORRECTED_OUTLIER_THRESHOLD plus the overhead, the difference threshold is still calibrated.
+ * 
+ * The difference threshold is DIFF_SIGMA standard deviations of the differences of means of CALIBRATION_PAIRS 
+ * scratch line pairs. The standard deviation comes from the median absolute difference, so the pairs of scratch 
+ * lines that happen to collide with the victim do not inflate it. With a colliding address, the same number of 
+ * pairs of it and its control address give the collision differences. The threshold is then the middle between 
+ * both distributions and SPRT_EFFECT is replaced by the median collision difference.
+ * 
+ * @param colliding -> an address that collides with the victim, may be NULL
+ */
+void calibrate(uint64_t *victim, void* colliding){
+    uint64_t *hits = calloc(CALIBRATION_MAX_CYCLES + 1, sizeof(uint64_t));
+    uint64_t *misses = calloc(CALIBRATION_MAX_CYCLES + 1, sizeof(uint64_t));
+    uint64_t *writes = calloc(CALIBRATION_MAX_CYCLES + 1, sizeof(uint64_t));
+
+    // Timer overhead, the empty kernels
+    uint8_t *buffer = malloc((CALIBRATION_PAGES + 1) * 0x1000);
+    uint8_t *page = (uint8_t*)(((uint64_t) buffer + 0xFFF) & ~0xFFFULL);
+    memset(page, 0, CALIBRATION_PAGES * 0x1000);
+    for(int i = 0; i < CALIBRATION_SAMPLES; i++){
+        uint64_t t = time_load_overhead();
+        hits[t < CALIBRATION_MAX_CYCLES ? t : CALIBRATION_MAX_CYCLES]++;
+        t = measure_overhead(victim, page + (i % CALIBRATION_PAGES) * 0x1000 + ((uint64_t) victim & 0xFC0));
+        writes[t < CALIBRATION_MAX_CYCLES ? t : CALIBRATION_MAX_CYCLES]++;
+    }
+    load_overhead = percentile(hits, CALIBRATION_SAMPLES, 0.5);
+    write_overhead = percentile(writes, CALIBRATION_SAMPLES, 0.5);
+    printf("Timer overhead: load median %lu (1%% %lu, 99%% %lu), Write+Write median %lu (1%% %lu, 99%% %lu)\n", 
+        load_overhead, percentile(hits, CALIBRATION_SAMPLES, 0.01), percentile(hits, CALIBRATION_SAMPLES, 0.99),
+        write_overhead, percentile(writes, CALIBRATION_SAMPLES, 0.01), percentile(writes, CALIBRATION_SAMPLES, 0.99));
+
+    #ifdef CORRECTED_THRESHOLDS
+    cache_miss_threshold = CORRECTED_MISS_THRESHOLD * timer_scale + load_overhead;
+    outlier_threshold = CORRECTED_OUTLIER_THRESHOLD * timer_scale + write_overhead;
+    #else
+    memset(hits, 0, (CALIBRATION_MAX_CYCLES + 1) * sizeof(uint64_t));
+    memset(writes, 0, (CALIBRATION_MAX_CYCLES + 1) * sizeof(uint64_t));
+    for(int i = 0; i < CALIBRATION_SAMPLES; i++){
+        asm volatile("movq (%0), %%rax\n" : : "r"(victim) : "rax");
+        uint64_t t = time_load(victim);
+        hits[t < CALIBRATION_MAX_CYCLES ? t : CALIBRATION_MAX_CYCLES]++;
+
+        asm volatile("clflush (%0)\n\tmfence\n\t" : : "r"(victim) : "memory");
+        t = time_load(victim);
+        misses[t < CALIBRATION_MAX_CYCLES ? t : CALIBRATION_MAX_CYCLES]++;
+    }
+
+    // Write+Write samples against lines of the same page offset, these mostly do not collide
+    for(int i = 0; i < CALIBRATION_SAMPLES; i++){
+        void *candidate = page + (i % CALIBRATION_PAGES) * 0x1000 + ((uint64_t) victim & 0xFC0);
+        uint64_t t = measure_write(victim, candidate, get_control_address(candidate), i & 1);
+        writes[t < CALIBRATION_MAX_CYCLES ? t : CALIBRATION_MAX_CYCLES]++;
+    }
+
+    uint64_t hit = percentile(hits, CALIBRATION_SAMPLES, 0.5);
+    uint64_t miss = percentile(misses, CALIBRATION_SAMPLES, 0.5);
+    uint64_t hit_high = percentile(hits, CALIBRATION_SAMPLES, 0.99);
+    uint64_t miss_low = percentile(misses, CALIBRATION_SAMPLES, 0.01);
+    printf("Hit / Miss stats (corrected)\n");
+    printf("Hit: median %lu (%lu), 99%% %lu\n", hit, corrected(hit, load_overhead), hit_high);
+    printf("Miss: median %lu (%lu), 1%% %lu\n", miss, corrected(miss, load_overhead), miss_low);
+    if(hit_high < miss_low && miss_low < CALIBRATION_MAX_CYCLES){
+        cache_miss_threshold = (hit_high + miss_low) / 2;
+    }else if(miss > hit + 2 && miss < CALIBRATION_MAX_CYCLES){
+        // Valley of the smoothed histogram of hits and misses between both modes. The threshold is the middle of 
+        // the valley, the first minimum would put it right above the hit mode.
+        uint64_t first = hit + 1, last = hit + 1;
+        uint64_t best_count = UINT64_MAX;
+        for(uint64_t t = hit + 1; t < miss; t++){
+            uint64_t count = 0;
+            for(uint64_t d = t < 2 ? 0 : t - 2; d <= t + 2 && d <= CALIBRATION_MAX_CYCLES; d++){
+                count += hits[d] + misses[d];
+            }
+            if(count < best_count){
+                best_count = count;
+                first = t;
+            }
+            if(count == best_count){
+                last = t;
+            }
+        }
+        cache_miss_threshold = (first + last) / 2;
+    }else{
+        printf("Hits and misses cannot be separated, keeping the default\n");
+    }
+
+    uint64_t write_median = percentile(writes, CALIBRATION_SAMPLES, 0.5);
+    uint64_t write_outlier = percentile(writes, CALIBRATION_SAMPLES, OUTLIER_PERCENTILE);
+    printf("Write+Write: median %lu (%lu), %.1f%% %lu", write_median, corrected(write_median, write_overhead), 
+        OUTLIER_PERCENTILE * 100, write_outlier);
+    // Colliding writes are slower, the outlier threshold must not cut off their mode. With a colliding address, 
+    // its percentile comes from samples of both classes, else the non-colliding one is shifted by the effect.
+    uint64_t colliding_outlier = write_outlier + (uint64_t) sprt_effect;
+    if(colliding != NULL){
+        memset(writes, 0, (CALIBRATION_MAX_CYCLES + 1) * sizeof(uint64_t));
+        for(int i = 0; i < CALIBRATION_SAMPLES; i++){
+            uint64_t t = measure_write(victim, colliding, get_control_address(colliding), i & 1);
+            writes[t < CALIBRATION_MAX_CYCLES ? t : CALIBRATION_MAX_CYCLES]++;
+        }
+        colliding_outlier = percentile(writes, CALIBRATION_SAMPLES, OUTLIER_PERCENTILE);
+        printf(", with collisions %.1f%% %lu", OUTLIER_PERCENTILE * 100, colliding_outlier);
+    }
+    printf("\n");
+    if(colliding_outlier > write_outlier){
+        write_outlier = colliding_outlier;
+    }
+    if(write_outlier < CALIBRATION_MAX_CYCLES){
+        outlier_threshold = write_outlier;
+    }
+    #endif // CORRECTED_THRESHOLDS
+
+    // Differences of means of non-colliding pairs and, with a colliding address, of colliding pairs
+    double *diffs = malloc(CALIBRATION_PAIRS * sizeof(double));
+    for(int i = 0; i < CALIBRATION_PAIRS; i++){
+        void *candidate = page + (i % CALIBRATION_PAGES) * 0x1000 + ((uint64_t) victim & 0xFC0);
+        diffs[i] = fabs(pair_difference(victim, candidate, get_control_address(candidate)));
+    }
+    qsort(diffs, CALIBRATION_PAIRS, sizeof(double), compare_double);
+    // A difference of means averages RUNS/2 rounds. The median absolute difference estimates its standard 
+    // deviation robustly, the few pairs of scratch lines that collide with the victim do not shift it.
+    double sd = diffs[CALIBRATION_PAIRS / 2] / 0.6745;
+    double noise = DIFF_SIGMA * sd;
+    diff_threshold = noise;
+    sprt_variance = sd * sd * RUNS / 2;
+    printf("Difference of means: no collision sd %.1f, %.2f sd %.1f", sd, DIFF_SIGMA, noise);
+    if(colliding != NULL){
+        for(int i = 0; i < CALIBRATION_PAIRS; i++){
+            diffs[i] = pair_difference(victim, colliding, get_control_address(colliding));
+        }
+        qsort(diffs, CALIBRATION_PAIRS, sizeof(double), compare_double);
+        double low = diffs[(int) (COLLISION_PERCENTILE * (CALIBRATION_PAIRS - 1))];
+        double effect = diffs[CALIBRATION_PAIRS / 2];
+        printf(", collision median %.1f, %.1f%% %.1f", effect, COLLISION_PERCENTILE * 100, low);
+        if(effect > noise){
+            diff_threshold = low > noise ? (noise + low) / 2 : noise;
+            sprt_effect = effect;
+        }else{
+            printf(" (not separable)");
+        }
+    }
+    printf("\nDifference threshold: %.1f, SPRT effect: %.1f, SPRT round variance: %.1f\n", diff_threshold, sprt_effect, 
+        sprt_variance);
+    free(diffs);
+    printf("Cache miss threshold: %lu (%lu corrected), outlier threshold: %lu (%lu corrected)\n", cache_miss_threshold, 
+        corrected(cache_miss_threshold, load_overhead), outlier_threshold, corrected(outlier_threshold, write_overhead));
+
+    free(buffer);
+    free(hits);
+    free(misses);
+    free(writes);
+}
+
+/**
+ * @brief Returns true if the CPU supports the serialize instruction, CPUID.(EAX=7,ECX=0):EDX[14].
+ */
+bool serialize_supported(){
+    unsigned int eax, ebx, ecx, edx;
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (edx & (1 << 14));
+}
+
+static const char* serialization_names[SERIALIZE_VARIANTS] = {"cpuid", "lfence", "mfence", "serialize"};
+
+/**
+ * @brief Returns the SERIALIZE_* variant with the given name, or -1.
+ */
+int parse_serialization(const char* name){
+    for(int i = 0; i < SERIALIZE_VARIANTS; i++){
+        if(strcmp(name, serialization_names[i]) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Mean and standard deviation of the histogram samples up to the OUTLIER_PERCENTILE.
+ */
+static void histogram_stats(uint64_t* hist, uint64_t samples, double* mean, double* sd){
+    uint64_t limit = percentile(hist, samples, OUTLIER_PERCENTILE);
+    double n = 0, sum = 0, sum_sq = 0;
+    for(uint64_t t = 0; t <= limit; t++){
+        n += hist[t];
+        sum += (double) hist[t] * t;
+        sum_sq += (double) hist[t] * t * t;
+    }
+    *mean = sum / n;
+    *sd = sqrt(sum_sq / n - *mean * *mean);
+}
+
+#ifdef SERIALIZATION_BENCH
+/**
+ * @brief Builds an eviction set for the victim and measures a member of it (collision) and its control 
+ * address (no collision) with every supported serialization variant. Prints the samples per second and the 
+ * separation d' = (mean collision - mean no collision) / pooled standard deviation of both classes. A generated 
+ * kernel (-j, -w) is regenerated with each serialization.
+ */
+void bench_serialization(struct candidate_pool_t* pool, uint64_t* victim){
+    bool success;
+    struct eviction_set_t* ev_set = build_evset(pool, victim, &success);
+    void* colliding = get_evset_len(ev_set) > 0 ? ev_set->address[0] : NULL;
+    if(colliding == NULL){
+        printf("No eviction set found, measuring non-colliding samples only\n");
+    }
+    void* control = get_control_address(colliding != NULL ? colliding : get_candidate(pool, 0));
+    uint64_t *hist[2];
+    hist[0] = malloc((CALIBRATION_MAX_CYCLES + 1) * sizeof(uint64_t));
+    hist[1] = malloc((CALIBRATION_MAX_CYCLES + 1) * sizeof(uint64_t));
+    int selected = serialization;
+
+    for(int variant = 0; variant < SERIALIZE_VARIANTS; variant++){
+        if(variant == SERIALIZE_INSTR && !serialize_supported()){
+            printf("%-10s not supported\n", serialization_names[variant]);
+            continue;
+        }
+        serialization = variant;
+        if(generated_kernel != NULL){
+            struct kernel_config_t config = generated_config;
+            config.serialization = variant;
+            install_kernel(&config);
+        }
+        memset(hist[0], 0, (CALIBRATION_MAX_CYCLES + 1) * sizeof(uint64_t));
+        memset(hist[1], 0, (CALIBRATION_MAX_CYCLES + 1) * sizeof(uint64_t));
+        uint64_t samples = 0;
+        uint64_t before = now_ns();
+        for(int i = 0; i < SERIALIZATION_BENCH_SAMPLES; i++){
+            uint64_t t = measure_write(victim, control, control, 0);
+            hist[0][t < CALIBRATION_MAX_CYCLES ? t : CALIBRATION_MAX_CYCLES]++;
+            samples++;
+            if(colliding != NULL){
+                t = measure_write(victim, colliding, colliding, 0);
+                hist[1][t < CALIBRATION_MAX_CYCLES ? t : CALIBRATION_MAX_CYCLES]++;
+                samples++;
+            }
+        }
+        double sec = (now_ns() - before) / 1e9;
+        double mean[2], sd[2];
+        histogram_stats(hist[0], SERIALIZATION_BENCH_SAMPLES, &mean[0], &sd[0]);
+        printf("%-10s %.0f samples/s, no collision: mean %.1f sd %.1f", serialization_names[variant], 
+            samples / sec, mean[0], sd[0]);
+        if(colliding != NULL){
+            histogram_stats(hist[1], SERIALIZATION_BENCH_SAMPLES, &mean[1], &sd[1]);
+            printf(", collision: mean %.1f sd %.1f, d' %.2f", mean[1], sd[1], 
+                (mean[1] - mean[0]) / sqrt((sd[0] * sd[0] + sd[1] * sd[1]) / 2));
+        }
+        printf("\n");
+    }
+    if(generated_kernel != NULL){
+        struct kernel_config_t config = generated_config;
+        config.serialization = selected;
+        install_kernel(&config);
+    }
+    serialization = selected;
+    free(hist[0]);
+    free(hist[1]);
+}
+#endif // SERIALIZATION_BENCH
+
+/**
+ * @brief Appends the serializing sequence of the given SERIALIZE_* variant to the code.
+ */
+static uint8_t* emit_serialization(uint8_t* code, int variant){
+    static const uint8_t cpuid[] = {0x0f, 0xae, 0xf0, 0x31, 0xc0, 0x0f, 0xa2}; // mfence; xor eax, eax; cpuid
+    static const uint8_t lfence[] = {0x0f, 0xae, 0xe8};
+    static const uint8_t mfence_lfence[] = {0x0f, 0xae, 0xf0, 0x0f, 0xae, 0xe8};
+    static const uint8_t serialize[] = {0x0f, 0x01, 0xe8};
+    switch(variant){
+        case SERIALIZE_LFENCE:
+            memcpy(code, lfence, sizeof(lfence));
+            return code + sizeof(lfence);
+        case SERIALIZE_MFENCE_LFENCE:
+            memcpy(code, mfence_lfence, sizeof(mfence_lfence));
+            return code + sizeof(mfence_lfence);
+        case SERIALIZE_INSTR:
+            memcpy(code, serialize, sizeof(serialize));
+            return code + sizeof(serialize);
+        default:
+            memcpy(code, cpuid, sizeof(cpuid));
+            return code + sizeof(cpuid);
+    }
+}
+
+/**
+ * @brief Appends the read of the selected timer into rax to the code.
+ */
+static uint8_t* emit_timestamp(uint8_t* code){
+    static const uint8_t rdtscp[] = {0x0f, 0x01, 0xf9, 0x48, 0xc1, 0xe2, 0x20, 0x48, 0x09, 0xd0}; // rdtscp; shl rdx, 32; or rax, rdx
+    if(timer == TIMER_COUNTING_THREAD){
+        uint64_t counter = (uint64_t) &timer_counter;
+        *code++ = 0x48;                         // movabs rax, (timer_counter)
+        *code++ = 0xa1;
+        memcpy(code, &counter, sizeof(counter));
+        return code + sizeof(counter);
+    }
+    memcpy(code, rdtscp, sizeof(rdtscp));
+    return code + sizeof(rdtscp);
+}
+
+/**
+ * @brief Appends the store of the given STORE_* variant to the code, to the candidate in rcx or to the 
+ * victim in r8. The line-wide variants expect the line base in the register.
+ */
+static uint8_t* emit_store(uint8_t* code, int store, bool victim){
+    switch(store){
+        case STORE_MOVNTI:
+            memcpy(code, victim ? (uint8_t[]){0x49, 0x0f, 0xc3, 0x10} : (uint8_t[]){0x48, 0x0f, 0xc3, 0x09}, 4); // movnti
+            return code + 4;
+        case STORE_AVX:
+            if(victim){
+                memcpy(code, (uint8_t[]){0xc4, 0xc1, 0x7e, 0x7f, 0x00}, 5); // vmovdqu (r8), ymm0
+                return code + 5;
+            }
+            memcpy(code, (uint8_t[]){0xc5, 0xfe, 0x7f, 0x01}, 4);     // vmovdqu (rcx), ymm0
+            return code + 4;
+        case STORE_AVX512:
+            memcpy(code, victim ? (uint8_t[]){0x62, 0xd1, 0xfe, 0x48, 0x7f, 0x00}  // vmovdqu64 (r8), zmm0
+                : (uint8_t[]){0x62, 0xf1, 0xfe, 0x48, 0x7f, 0x01}, 6);        // vmovdqu64 (rcx), zmm0
+            return code + 6;
+        case STORE_REP_STOSQ:
+            memcpy(code, victim ? (uint8_t[]){0x4c, 0x89, 0xc7} : (uint8_t[]){0x48, 0x89, 0xcf}, 3); // mov rdi, r8 / rcx
+            memcpy(code + 3, (uint8_t[]){0xb9, 0x08, 0x00, 0x00, 0x00, 0xf3, 0x48, 0xab}, 8);      // mov ecx, 8; rep stosq
+            return code + 11;
+        case STORE_REPEAT:
+            for(int i = 0; i < STORE_REPEAT_COUNT; i++){
+                // mov 8*i(r8), rdx / mov 8*i(rcx), rcx
+                memcpy(code, victim ? (uint8_t[]){0x49, 0x89, 0x50, 8 * i} : (uint8_t[]){0x48, 0x89, 0x49, 8 * i}, 4);
+                code += 4;
+            }
+            return code;
+        default:
+            memcpy(code, victim ? (uint8_t[]){0x49, 0x89, 0x10} : (uint8_t[]){0x48, 0x89, 0x09}, 3); // mov
+            return code + 3;
+    }
+}
+
+#define EMIT(...) do{ const uint8_t bytes[] = {__VA_ARGS__}; memcpy(code, bytes, sizeof(bytes)); code += sizeof(bytes); }while(0)
+
+/**
+ * @brief Writes the Write+Write kernel for the given configuration to the (writable) code page. The kernel
+ * has the signature of measure_write and follows the System V calling convention, rbx is saved for cpuid.
+ * Without timed_store it is the empty kernel that times the overhead only. The line-wide stores write the 
+ * lines of the candidate and the victim from their base.
+ * 
+ * @return the entry point of the kernel
+ */
+write_kernel_t emit_kernel(uint8_t* code, struct kernel_config_t* config){
+    bool line_store = config->store == STORE_AVX || config->store == STORE_AVX512 || config->store == STORE_REP_STOSQ || 
+        config->store == STORE_REPEAT;
+    code += config->alignment;
+    write_kernel_t entry = (write_kernel_t) code;
+    EMIT(0x53);                                 // push rbx
+    EMIT(0x49, 0x89, 0xf8);                     // mov r8, rdi (victim)
+    EMIT(0x49, 0x89, 0xf1);                     // mov r9, rsi (candidate_0)
+    EMIT(0x49, 0x89, 0xd2);                     // mov r10, rdx (candidate_1)
+    EMIT(0x41, 0x89, 0xcb);                     // mov r11d, ecx (decision)
+    if(line_store){
+        EMIT(0x49, 0x83, 0xe0, 0xc0);           // and r8, -64
+    }
+    code = emit_serialization(code, config->serialization);
+    EMIT(0x41, 0x0f, 0xae, 0x38);               // clflush (r8)
+    EMIT(0x45, 0x85, 0xdb);                     // test r11d, r11d
+    EMIT(0x4c, 0x89, 0xd1);                     // mov rcx, r10
+    EMIT(0x49, 0x0f, 0x44, 0xc9);               // cmove rcx, r9
+    if(line_store){
+        EMIT(0x48, 0x83, 0xe1, 0xc0);           // and rcx, -64
+    }
+    code = emit_store(code, config->store, false);
+    code = emit_serialization(code, config->serialization);
+    memset(code, 0x90, config->pre_nops);       // nop
+    code += config->pre_nops;
+    code = emit_timestamp(code);
+    EMIT(0x49, 0x89, 0xc1);                     // mov r9, rax
+    if(config->timed_store){
+        code = emit_store(code, config->store, true);
+    }
+    code = emit_serialization(code, config->serialization);
+    memset(code, 0x90, config->post_nops);
+    code += config->post_nops;
+    code = emit_timestamp(code);
+    EMIT(0x4c, 0x29, 0xc8);                     // sub rax, r9
+    if(config->store == STORE_AVX || config->store == STORE_AVX512){
+        EMIT(0xc5, 0xf8, 0x77);                 // vzeroupper
+    }
+    EMIT(0x5b);                                 // pop rbx
+    EMIT(0xc3);                                 // ret
+    return entry;
+}
+
+#undef EMIT
+
+/**
+ * @brief Emits the kernel into the given KERNEL_SLOT_* of the code page. The page is mapped on first use
+ * and kept W^X, it is writable only while the kernel is emitted.
+ * 
+ * @return the entry point of the kernel
+ */
+static write_kernel_t load_kernel(int slot, struct kernel_config_t* config){
+    static uint8_t* page = NULL;
+    if(page == NULL){
+        page = mmap(NULL, KERNEL_CODE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(page == MAP_FAILED){
+            perror("mmap");
+            exit(1);
+        }
+    }
+    if(mprotect(page, KERNEL_CODE_SIZE, PROT_READ | PROT_WRITE) != 0){
+        perror("mprotect");
+        exit(1);
+    }
+    write_kernel_t kernel = emit_kernel(page + slot * KERNEL_SLOT_SIZE, config);
+    if(mprotect(page, KERNEL_CODE_SIZE, PROT_READ | PROT_EXEC) != 0){
+        perror("mprotect");
+        exit(1);
+    }
+    return kernel;
+}
+
+/**
+ * @brief Makes the kernel of the given configuration and its empty kernel the ones of all measurements. 
+ * The timestamps are emitted for the selected timer.
+ */
+void install_kernel(struct kernel_config_t* config){
+    struct kernel_config_t empty = *config;
+    empty.timed_store = false;
+    generated_config = *config;
+    generated_kernel = load_kernel(KERNEL_SLOT_KERNEL, config);
+    generated_overhead_kernel = load_kernel(KERNEL_SLOT_OVERHEAD, &empty);
+    serialization = config->serialization;
+}
+
+/**
+ * @brief Measures the kernel samples times with the control address (no collision) and the colliding address.
+ * 
+ * @param mean -> means of both classes up to the OUTLIER_PERCENTILE
+ * @param us -> duration of all measurements in microseconds
+ * @return the separation d' = (mean collision - mean no collision) / pooled standard deviation
+ */
+static double measure_separation(write_kernel_t kernel, uint64_t* victim, void* colliding, void* control, int samples, 
+        double mean[2], double* us){
+    uint64_t *hist[2];
+    hist[0] = calloc(CALIBRATION_MAX_CYCLES + 1, sizeof(uint64_t));
+    hist[1] = calloc(CALIBRATION_MAX_CYCLES + 1, sizeof(uint64_t));
+    uint64_t before = now_ns();
+    for(int i = 0; i < samples; i++){
+        uint64_t t = kernel(victim, control, colliding, 0);
+        hist[0][t < CALIBRATION_MAX_CYCLES ? t : CALIBRATION_MAX_CYCLES]++;
+        t = kernel(victim, control, colliding, 1);
+        hist[1][t < CALIBRATION_MAX_CYCLES ? t : CALIBRATION_MAX_CYCLES]++;
+    }
+    *us = (now_ns() - before) / 1000.0;
+    double sd[2];
+    histogram_stats(hist[0], samples, &mean[0], &sd[0]);
+    histogram_stats(hist[1], samples, &mean[1], &sd[1]);
+    free(hist[0]);
+    free(hist[1]);
+    return (mean[1] - mean[0]) / sqrt((sd[0] * sd[0] + sd[1] * sd[1]) / 2);
+}
+
+/**
+ * @brief Returns a member of an eviction set for the victim, or NULL if the construction fails.
+ */
+static void* find_colliding_address(struct candidate_pool_t* pool, uint64_t* victim){
+    bool success;
+    bool was_verbose = verbose;
+    verbose = false;
+    struct eviction_set_t* ev_set = build_evset(pool, victim, &success);
+    verbose = was_verbose;
+    return success ? ev_set->address[0] : NULL;
+}
+
+/**
+ * @brief Builds an eviction set for the victim and generates the kernel with the selected store for every 
+ * combination of serialization, KERNEL_PRE_NOPS, KERNEL_POST_NOPS and KERNEL_ALIGNMENTS. Each variant measures 
+ * a member of the set and its control address KERNEL_TUNE_SAMPLES times, the variant with the highest d'^2 per
+ * microsecond is installed and the thresholds are calibrated again.
+ * 
+ * @return false if no eviction set was found or no variant separates the classes, the kernels stay unchanged
+ */
+bool autotune_kernel(struct candidate_pool_t* pool, uint64_t* victim, int store){
+    static const int pre_nops[] = KERNEL_PRE_NOPS;
+    static const int post_nops[] = KERNEL_POST_NOPS;
+    static const int alignments[] = KERNEL_ALIGNMENTS;
+    void* colliding = find_colliding_address(pool, victim);
+    if(colliding == NULL){
+        printf("Kernel autotuning needs an eviction set, keeping the current kernels\n");
+        return false;
+    }
+    void* control = get_control_address(colliding);
+    struct kernel_config_t config = {.timed_store = true, .store = store}, best = {0};
+    double best_score = 0;
+    uint64_t variants = 0;
+
+    for(config.serialization = 0; config.serialization < SERIALIZE_VARIANTS; config.serialization++){
+        if(config.serialization == SERIALIZE_INSTR && !serialize_supported()){
+            continue;
+        }
+        for(int p = 0; p < (int) (sizeof(pre_nops) / sizeof(int)); p++){
+            for(int q = 0; q < (int) (sizeof(post_nops) / sizeof(int)); q++){
+                for(int a = 0; a < (int) (sizeof(alignments) / sizeof(int)); a++){
+                    config.pre_nops = pre_nops[p];
+                    config.post_nops = post_nops[q];
+                    config.alignment = alignments[a];
+                    write_kernel_t kernel = load_kernel(KERNEL_SLOT_TRIAL, &config);
+                    double mean[2], us;
+                    double d = measure_separation(kernel, victim, colliding, control, KERNEL_TUNE_SAMPLES, mean, &us);
+                    // d'^2 grows linearly with the number of samples, per microsecond it compares the variants at equal time
+                    double score = d > 0 ? d * d * 2 * KERNEL_TUNE_SAMPLES / us : 0;
+                    if(score > best_score){
+                        best_score = score;
+                        best = config;
+                    }
+                    variants++;
+                }
+            }
+        }
+    }
+
+    if(best_score == 0){
+        printf("Kernel autotuning: none of %lu variants separates the classes, keeping the current kernels\n", variants);
+        return false;
+    }
+    install_kernel(&best);
+    printf("Kernel autotuning: %lu variants, best %s, %d + %d nops, alignment %d, %.3f d'^2/us\n", variants, 
+        serialization_names[best.serialization], best.pre_nops, best.post_nops, best.alignment, best_score);
+    calibrate(victim, colliding);
+    return true;
+}
+
+static const char* store_names[STORE_VARIANTS] = {"mov", "movnti", "avx", "avx512", "rep", "repeat"};
+
+/**
+ * @brief Returns true if the CPU and the OS support the given STORE_* variant.
+ */
+bool store_supported(int store){
+    if(store == STORE_AVX){
+        return __builtin_cpu_supports("avx");
+    }
+    if(store == STORE_AVX512){
+        return __builtin_cpu_supports("avx512f");
+    }
+    return true;
+}
+
+/**
+ * @brief Returns the STORE_* variant with the given name, or -1.
+ */
+int parse_store(const char* name){
+    for(int i = 0; i < STORE_VARIANTS; i++){
+        if(strcmp(name, store_names[i]) == 0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+#ifdef STORE_BENCH
+/**
+ * @brief Builds an eviction set for the victim and measures a member of it and its control address with every 
+ * supported store variant, with the selected serialization and the default padding. Prints the means, the 
+ * effect size d' and the measurements per class that reach a separation of STORE_BENCH_SIGMA.
+ */
+void bench_stores(struct candidate_pool_t* pool, uint64_t* victim){
+    void* colliding = find_colliding_address(pool, victim);
+    if(colliding == NULL){
+        printf("No eviction set found\n");
+        return;
+    }
+    void* control = get_control_address(colliding);
+    for(int store = 0; store < STORE_VARIANTS; store++){
+        if(!store_supported(store)){
+            printf("%-8s not supported\n", store_names[store]);
+            continue;
+        }
+        struct kernel_config_t config = {serialization, 16, 11, 0, true, store};
+        write_kernel_t kernel = load_kernel(KERNEL_SLOT_TRIAL, &config);
+        double mean[2], us;
+        double d = measure_separation(kernel, victim, colliding, control, STORE_BENCH_SAMPLES, mean, &us);
+        printf("%-8s no collision %.1f, collision %.1f, difference %.1f, d' %.2f", store_names[store], mean[0], mean[1],
+            mean[1] - mean[0], d);
+        if(d > 0){
+            // The difference of the means of n samples each has a standard deviation of sqrt(2/n)
+            printf(", %.0f measurements per class for %d sigma", ceil(2 * STORE_BENCH_SIGMA * STORE_BENCH_SIGMA / (d * d)), 
+                STORE_BENCH_SIGMA);
+        }
+        printf("\n");
+    }
+}
+#endif // STORE_BENCH
+
+
+#if defined(USE_LIBTEA) || defined(VERIFY)
+void setup_libtea(){
+    instance = libtea_init();
+    if (!instance){
+        printf("Libtea initialization failed\n");
+    }
+}
+#endif
+
+/**
+ * @brief Incremental construction: scans the pool in chunks of CHUNK_CANDIDATES. The eviction set keeps the 
+ * addresses reduced so far, the ones found in the next chunk are appended and reduced against them.
+ * 
+ * @param success -> true if the set was reduced to a minimal eviction set
+ * @return the eviction set, with a deadline the best set so far
+ */
+struct eviction_set_t* build_evset(struct candidate_pool_t* pool, uint64_t* victim, bool* success){
+    return build_evset_from(pool, victim, NULL, true, NULL, success);
+}
+
+/**
+ * @brief Like build_evset, but the seed candidates are scanned first, then the pool if scan_pool is set.
+ * 
+ * @param seeds -> candidates that likely collide with the victim, may be NULL
+ * @param collisions -> if not NULL, every colliding candidate of the scan is appended to it, before the reduction
+ */
+struct eviction_set_t* build_evset_from(struct candidate_pool_t* pool, uint64_t* victim, struct candidate_queue_t* seeds, 
+        bool scan_pool, struct eviction_set_t* collisions, bool* success){
+    struct eviction_set_t *ev_set = new_evset(EVSET_INITIAL_CAPACITY);
+    int reduced = 0;
+    uint64_t chunks = 0, scanned = 0, len;
+    uint64_t seed_count = seeds ? seeds->len : 0;
+    uint64_t end = seed_count + (scan_pool ? pool->count / CHUNK_CANDIDATES * CHUNK_CANDIDATES : 0);
+    *success = false;
+    for(uint64_t i = 0; i < end; i += len){
+        // Stop scanning once the rest of the budget is needed for the reduction
+        if(scan_over_deadline(get_evset_len(ev_set))){
+            break;
+        }
+        struct eviction_set_t *res;
+        if(i < seed_count){
+            len = seed_count - i < CHUNK_CANDIDATES ? seed_count - i : CHUNK_CANDIDATES;
+            res = get_evset(pool, victim, seeds->candidates, i, len);
+        }else{
+            len = CHUNK_CANDIDATES;
+            res = get_evset(pool, victim, NULL, i - seed_count, len);
+        }
+        chunks++;
+        scanned += len;
+        if(collisions != NULL){
+            merge_evsets(&collisions, &res);
+        }
+        merge_evsets(&ev_set, &res);
+        if (test_evset(victim, ev_set)){
+            if (reduce_evset(victim, ev_set, reduced)){
+                if(verbose){
+                    printf("Reduction was successfull\n");
+                }
+                *success = true;
+                break;
+            }
+            // The set evicted the victim before the reduction, only verified addresses were removed
+            reduced = get_evset_len(ev_set);
+        }
+        if(deadline_passed()){
+            break;
+        }
+    }
+    if(verbose){
+        printf("Scanned %lu chunks, %lu candidates\n", chunks, scanned);
+    }
+    if(!*success && deadline_ns != 0 && get_evset_len(ev_set) > 0){
+        // Reduce as far as the rest of the budget allows
+        if(!deadline_passed() && test_evset(victim, ev_set) && reduce_evset(victim, ev_set, reduced)){
+            if(verbose){
+                printf("Reduction was successfull\n");
+            }
+            *success = true;
+        }else{
+            print_best_effort(victim, ev_set);
+        }
+    }
+    return ev_set;
+}
+
+/**
+ * @brief Reads an integer from a sysfs file, returns -1 on failure.
+ */
+static long read_sysfs_long(const char* path){
+    FILE *f = fopen(path, "r");
+    long value = -1;
+    if(f){
+        if(fscanf(f, "%ld", &value) != 1){
+            value = -1;
+        }
+        fclose(f);
+    }
+    return value;
+}
+
+/**
+ * @brief Reads a sysfs CPU list like "0-3,8-11" into set, returns false on failure.
+ */
+static bool read_sysfs_cpu_list(const char* path, cpu_set_t* set){
+    FILE *f = fopen(path, "r");
+    bool ok = false;
+    CPU_ZERO(set);
+    if(!f){
+        return false;
+    }
+    int first, last;
+    while(fscanf(f, "%d", &first) == 1){
+        last = first;
+        int c = fgetc(f);
+        if(c == '-'){
+            if(fscanf(f, "%d", &last) != 1){
+                break;
+            }
+            c = fgetc(f);
+        }
+        for(int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++){
+            CPU_SET(cpu, set);
+        }
+        ok = true;
+        if(c != ','){
+            break;
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+/**
+ * @brief Returns the number of physical cores the process may run on and writes the first 
+ * logical CPU of each to cpus. SMT siblings share the store buffer, so only one of them is used.
+ */
+int get_physical_cores(int* cpus, int max){
+    cpu_set_t allowed;
+    int core_id[max], package_id[max];
+    int n = 0;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0){
+        cpus[0] = 0;
+        return 1;
+    }
+    for(int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++){
+        if(!CPU_ISSET(cpu, &allowed)){
+            continue;
+        }
+        char path[128];
+        int core = cpu, package = 0;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        FILE *f = fopen(path, "r");
+        if(f){
+            if(fscanf(f, "%d", &core) != 1){
+                core = cpu;
+            }
+            fclose(f);
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        f = fopen(path, "r");
+        if(f){
+            if(fscanf(f, "%d", &package) != 1){
+                package = 0;
+            }
+            fclose(f);
+        }
+        bool sibling = false;
+        for(int i = 0; i < n; i++){
+            if(core_id[i] == core && package_id[i] == package){
+                sibling = true;
+                break;
+            }
+        }
+        if(!sibling){
+            cpus[n] = cpu;
+            core_id[n] = core;
+            package_id[n] = package;
+            n++;
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Increments timer_counter forever, the loop of libtea__arch_counting_thread.
+ */
+void* counting_thread(void* arg){
+    (void) arg;
+    asm volatile("1: inc %%rax\n\t"
+                 "mov %%rax, (%%rcx)\n\t"
+                 "jmp 1b" : : "c"(&timer_counter.value), "a"(0));
+    return NULL;
+}
+
+/**
+ * @brief Starts the counting thread. Like libtea's counting thread, it is pinned to the SMT sibling of the 
+ * measuring CPU, which reads the counter from the shared L1. Without an allowed sibling, it runs on another 
+ * physical core. With a single CPU, the counter only advances while the measurements are descheduled, the 
+ * thread is then only started with shared == true.
+ * 
+ * @return false if the thread was not started
+ */
+bool start_counting_thread(bool shared){
+    int cpus[BATCH_MAX_THREADS];
+    int cores = get_physical_cores(cpus, BATCH_MAX_THREADS);
+    int counter_cpu = -1;
+    cpu_set_t allowed, siblings;
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpus[0]);
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) == 0 && read_sysfs_cpu_list(path, &siblings)){
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+            if(cpu != cpus[0] && CPU_ISSET(cpu, &siblings) && CPU_ISSET(cpu, &allowed)){
+                counter_cpu = cpu;
+                break;
+            }
+        }
+    }
+    if(counter_cpu < 0 && cores > 1){
+        counter_cpu = cpus[1];
+    }
+    if(counter_cpu < 0 && sched_getaffinity(0, sizeof(allowed), &allowed) == 0){
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+            if(cpu != cpus[0] && CPU_ISSET(cpu, &allowed)){
+                counter_cpu = cpu;
+                break;
+            }
+        }
+    }
+
+    if(counter_cpu < 0 && !shared){
+        printf("Warning: only one CPU, keeping the TSC\n");
+        return false;
+    }
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, counting_thread, NULL) != 0){
+        perror("pthread_create");
+        return false;
+    }
+    if(counter_cpu >= 0){
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        CPU_SET(counter_cpu, &mask);
+        pthread_setaffinity_np(thread, sizeof(mask), &mask);
+        // Only the measuring thread is pinned, threads it creates later inherit the mask
+        CPU_ZERO(&mask);
+        CPU_SET(cpus[0], &mask);
+        pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+        printf("Counting thread on CPU %d, measurements on CPU %d\n", counter_cpu, cpus[0]);
+    }else{
+        printf("Warning: only one CPU, the counting thread shares it with the measurements\n");
+    }
+    // Wait until the counter runs
+    while(timer_counter.value == 0){
+        sched_yield();
+    }
+    return true;
+}
+
+/**
+ * @brief Reads the TSC.
+ */
+static inline uint64_t read_tsc(){
+    uint64_t t;
+    asm volatile("rdtscp\n\tshl $32, %%rdx\n\tor %%rdx, %%rax\n\t" : "=a"(t) : : "rcx", "rdx");
+    return t;
+}
+
+static int compare_u64(const void* a, const void* b){
+    uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * @brief Times TIMER_PROBE_SAMPLES back-to-back reads of the TSC or the counter.
+ * 
+ * @param median -> median difference of two reads
+ * @param resolution -> greatest common divisor of the differences, the step of the timer, 0 if it did not move
+ */
+static void probe_timer(int kind, uint64_t* median, uint64_t* resolution){
+    uint64_t deltas[TIMER_PROBE_SAMPLES];
+    for(int i = 0; i < TIMER_PROBE_SAMPLES; i++){
+        if(kind == TIMER_COUNTING_THREAD){
+            uint64_t a = timer_counter.value;
+            deltas[i] = timer_counter.value - a;
+        }else{
+            uint64_t a = read_tsc();
+            deltas[i] = read_tsc() - a;
+        }
+    }
+    qsort(deltas, TIMER_PROBE_SAMPLES, sizeof(uint64_t), compare_u64);
+    *median = deltas[TIMER_PROBE_SAMPLES / 2];
+    *resolution = 0;
+    for(int i = 0; i < TIMER_PROBE_SAMPLES; i++){
+        uint64_t a = *resolution, b = deltas[i];
+        while(b != 0){
+            uint64_t r = a % b;
+            a = b;
+            b = r;
+        }
+        *resolution = a;
+    }
+}
+
+/**
+ * @brief Returns the counter ticks per TSC cycle over TIMER_SCALE_NS. The TSC is only read at both ends, so a 
+ * trapping TSC does not distort the ratio.
+ */
+static double measure_timer_scale(){
+    uint64_t start = now_ns();
+    uint64_t tsc = read_tsc();
+    uint64_t ticks = timer_counter.value;
+    while(now_ns() - start < TIMER_SCALE_NS){
+        sched_yield();
+    }
+    return (timer_counter.value - ticks) / (double) (read_tsc() - tsc);
+}
+
+/**
+ * @brief Selects the timer of the kernels. The counting thread replaces the TSC if forced, if back-to-back 
+ * rdtscp take longer than TSC_TRAP_CYCLES (the TSC traps to the hypervisor) or if the step of the TSC 
+ * is above TSC_MAX_RESOLUTION (the TSC is coarse). Without a second CPU, only a forced counting thread is started.
+ */
+void select_timer(bool force_counter){
+    uint64_t median, resolution;
+    probe_timer(TIMER_TSC, &median, &resolution);
+    printf("TSC: back-to-back rdtscp median %lu, resolution %lu\n", median, resolution);
+    if(!force_counter && median <= TSC_TRAP_CYCLES && resolution != 0 && resolution <= TSC_MAX_RESOLUTION){
+        return;
+    }
+    if(!force_counter){
+        printf("The TSC %s, switching to the counting thread\n", median > TSC_TRAP_CYCLES ? "traps" : "is coarse");
+    }
+    if(start_counting_thread(force_counter)){
+        timer = TIMER_COUNTING_THREAD;
+        probe_timer(TIMER_COUNTING_THREAD, &median, &resolution);
+        printf("Counting thread: back-to-back median %lu, resolution %lu\n", median, resolution);
+        // The thresholds that are defined in cycles, calibrate() replaces the cache miss and outlier thresholds
+        timer_scale = measure_timer_scale();
+        if(timer_scale <= 0){
+            printf("Warning: the counter did not advance, keeping the thresholds in cycles\n");
+            timer_scale = 1;
+        }
+        probe_min = PROBE_MIN_CYCLES * timer_scale;
+        probe_max = PROBE_MAX_CYCLES * timer_scale;
+        diff_threshold = DIFF_THRESHOLD * timer_scale;
+        sprt_effect = SPRT_EFFECT * timer_scale;
+        cache_miss_threshold = CACHE_MISS_THRESHOLD * timer_scale;
+        outlier_threshold = OUTLIER_THRESHOLD * timer_scale;
+        printf("Counting thread: %.3f ticks per TSC cycle\n", timer_scale);
     }
-    #ifndef TRY_UNTIL_SUCCESS
-    // Print timing stats.
-    clock_t difference = clock() - before;
-    printf("############\n\n");
-    long msec = difference * 1000 / CLOCKS_PER_SEC;
-    printf("Time taken %ld seconds %ld milliseconds\n",
-        msec/1000, msec%1000);
-    
-
-    #ifdef USE_LIBTEA
-    printf("\nResult: %d matches, thereof %d false positives.\n\n", success_ctr+failure_ctr, failure_ctr);
-    #else
-    printf("\nResult: %d matches.\n\n", success_ctr);
-    #endif
-    #endif // TRY_UNTIL_SUCCESS
-    return ev_set;
 }
 
+#ifdef TIMER_BENCH
 /**
- * @brief Returns true if the ev_set was successfully reduced to a minimal ev-set
- * 
- * @param victim -> the victim address
- * @param ev_set_ptr -> a pointer to the start pointer of the eviction set
- * @return true if successful
- * @return false else
+ * @brief Compares the TSC and the counting thread: resolution and median of back-to-back reads, reads per
+ * second, and Write+Write measurements per second with the median victim write latency in timer units. A 
+ * generated kernel (-j, -w) is emitted again with the timestamps of each timer.
  */
-bool reduce_evset(uint64_t *victim, struct eviction_set_t **ev_set_ptr){
-    struct eviction_set_t *ev_set = *ev_set_ptr;
-    int len = get_evset_len(ev_set);
-    int abort_ctr = 0;
+void bench_timers(uint64_t* victim){
+    if(timer != TIMER_COUNTING_THREAD && !start_counting_thread(true)){
+        return;
+    }
+    uint8_t *buffer = malloc((CALIBRATION_PAGES + 1) * 0x1000);
+    uint8_t *page = (uint8_t*)(((uint64_t) buffer + 0xFFF) & ~0xFFFULL);
+    memset(page, 0, CALIBRATION_PAGES * 0x1000);
+    uint64_t *samples = malloc(TIMER_BENCH_SAMPLES * sizeof(uint64_t));
+    int selected = timer;
 
-    // If this fails CACHE_ASSOC times, chances are that something went wrong...
-    while(abort_ctr < CACHE_ASSOC+2){
-        // get the current eviction set 
-        ev_set = *ev_set_ptr;
-        // Check whether the current eviction set is functional, if not return false
-        if(test_evset(victim, ev_set) == false){
-            return false;
+    for(timer = 0; timer < TIMERS; timer++){
+        uint64_t median, resolution;
+        probe_timer(timer, &median, &resolution);
+        if(generated_kernel != NULL){
+            install_kernel(&generated_config);
         }
-        // If the eviction set works and has length w, we are done -> return true.
-        if(len == CACHE_ASSOC){
-            // We do a double check whether it actually works...
-            if(test_evset(victim, ev_set) == false){
-                return false;
-            }
-            return true;
+
+        volatile uint64_t sink = 0;
+        uint64_t before = now_ns();
+        for(int i = 0; i < TIMER_BENCH_SAMPLES; i++){
+            sink += timer == TIMER_COUNTING_THREAD ? timer_counter.value : read_tsc();
         }
-        
-        // Remove the first element from the eviction set
-        struct eviction_set_t *removed_element = ev_set;
-        *ev_set_ptr = ev_set->next;
-        removed_element->next = NULL;
-
-        // Recursive call to this function with a smaller eviction set. 
-        // If this returns true, the smaller eviction set is functional and we can free the removed element.
-        if(reduce_evset(victim, ev_set_ptr) == true){
-            free(removed_element);
-            return true;
+        double reads = TIMER_BENCH_SAMPLES / ((now_ns() - before) / 1e9);
+
+        before = now_ns();
+        for(int i = 0; i < TIMER_BENCH_SAMPLES; i++){
+            void *candidate = page + (i % CALIBRATION_PAGES) * 0x1000 + ((uint64_t) victim & 0xFC0);
+            samples[i] = measure_write(victim, candidate, candidate, 0);
         }
-        // If the reduced eviction set did not work, we need to re-insert the removed element and try again.
-        append_evset_address(*ev_set_ptr, removed_element);
-        abort_ctr ++;
+        double writes = TIMER_BENCH_SAMPLES / ((now_ns() - before) / 1e9);
+        qsort(samples, TIMER_BENCH_SAMPLES, sizeof(uint64_t), compare_u64);
+        printf("%-15s resolution %lu, back-to-back median %lu, %.0f reads/s, %.0f Write+Write samples/s, median write %lu\n",
+            timer == TIMER_COUNTING_THREAD ? "Counting thread:" : "TSC:", resolution, median, reads, writes, 
+            samples[TIMER_BENCH_SAMPLES / 2]);
     }
-    return false;
+    timer = selected;
+    if(generated_kernel != NULL){
+        install_kernel(&generated_config);
+    }
+    free(samples);
+    free(buffer);
 }
+#endif // TIMER_BENCH
 
 /**
- * @brief Appends an address to the eviction set list.
+ * @brief Worker thread of the batch mode: pins itself to its core and builds eviction sets for the 
+ * victims of the batch in its slice of the candidate pool until all victims are taken.
  */
-void append_evset_address(struct eviction_set_t* ev_set, struct eviction_set_t* e){
-    struct eviction_set_t *current = ev_set;
-    while(current->next->next != NULL){
-        current = current->next;
+void* evset_worker(void* arg){
+    struct worker_t *worker = (struct worker_t*) arg;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    verbose = false;
+
+    uint64_t v;
+    while((v = __atomic_fetch_add(worker->next_victim, 1, __ATOMIC_RELAXED)) < worker->victim_count){
+        uint64_t *victim = worker->victims[v];
+        struct candidate_pool_t slice = worker->slice;
+        bool success;
+        init_candidate_pool(&slice, victim);
+        build_evset(&slice, victim, &success);
+        if(success){
+            worker->successes++;
+        }
+        reset_evset_arena();
     }
-    struct eviction_set_t *last = current->next;
-    current->next = e;
-    e->next = last;
+    worker->measurements = measurement_ctr;
+    free_evset_arena();
+    return NULL;
 }
 
-void merge_evsets(struct eviction_set_t** a, struct eviction_set_t** b){
-    if(*a == NULL){
-        *a = *b;
-    }else{
-        struct eviction_set_t *current = *a;
-        while(current->next->next != NULL){
-            current = current->next;
+/**
+ * @brief Builds eviction sets for a batch of victims with 1, 2, 4, ... worker threads, one per physical core, 
+ * up to max_threads. Every worker gets an equal slice of the candidate pool. Prints the eviction sets per 
+ * second for each thread count.
+ */
+void run_batch(struct candidate_pool_t* pool, uint64_t victim_count, int max_threads){
+    int cpus[BATCH_MAX_THREADS];
+    int cores = get_physical_cores(cpus, BATCH_MAX_THREADS);
+    if(max_threads <= 0 || max_threads > cores){
+        max_threads = cores;
+    }
+    printf("Batch: %lu victims, %d physical cores, up to %d threads\n", victim_count, cores, max_threads);
+
+    // The victims lie in different pages and at different page offsets
+    uint8_t *victim_pages = aligned_alloc(0x1000, victim_count * 0x1000);
+    uint64_t **victims = malloc(victim_count * sizeof(uint64_t*));
+    for(uint64_t v = 0; v < victim_count; v++){
+        victims[v] = (uint64_t*) (victim_pages + v * 0x1000 + (v * 64) % 0x1000);
+        *victims[v] = 0;
+    }
+
+    struct worker_t workers[BATCH_MAX_THREADS];
+    for(int threads = 1; ; threads *= 2){
+        if(threads > max_threads){
+            threads = max_threads;
+        }
+        uint64_t slice_size = (pool->size / threads) & ~(pool->page_size - 1);
+        uint64_t next_victim = 0;
+        uint64_t start = now_ns();
+        for(int t = 0; t < threads; t++){
+            workers[t].cpu = cpus[t];
+            workers[t].slice = *pool;
+            workers[t].slice.base = (uint8_t*) pool->base + t * slice_size;
+            workers[t].slice.size = slice_size;
+            workers[t].victims = victims;
+            workers[t].victim_count = victim_count;
+            workers[t].next_victim = &next_victim;
+            workers[t].successes = 0;
+            workers[t].measurements = 0;
+            pthread_create(&workers[t].thread, NULL, evset_worker, &workers[t]);
+        }
+        int successes = 0;
+        uint64_t measurements = 0;
+        for(int t = 0; t < threads; t++){
+            pthread_join(workers[t].thread, NULL);
+            successes += workers[t].successes;
+            measurements += workers[t].measurements;
+        }
+        double sec = (now_ns() - start) / 1e9;
+        printf("Threads: %2d, eviction sets: %d / %lu, %lu measurements, %.3f s, %.1f eviction sets per second\n", 
+            threads, successes, victim_count, measurements, sec, successes / sec);
+        if(threads == max_threads){
+            break;
         }
-        free(current->next); // delete the old end-item
-        current->next = *b;
     }
-    
+    free(victims);
+    free(victim_pages);
 }
 
 /**
- * @brief Get the length of the eviction set
+ * @brief Derives an eviction set for another line offset: the lines at the given page offset in the pages of ev_set. 
+ * The pages of ev_set are congruent at their offset, so they differ neither in the set index bits above the page 
+ * offset nor (for slice hashes that are linear in the address bits) in the slice hash of the page. Their lines 
+ * at any other offset are then congruent as well. The derived set needs to be verified with test_evset.
  */
-int get_evset_len(struct eviction_set_t* ev_set){
-    int i = 0;
-    struct eviction_set_t *current = ev_set;
-    while(current->next != NULL){
-        i++;
-        current = current->next;
+struct eviction_set_t* shift_evset(struct eviction_set_t* ev_set, int offset){
+    struct eviction_set_t *shifted = new_evset(ev_set->len);
+    for(int i = 0; i < ev_set->len; i++){
+        append_evset_address(shifted, (uint64_t*) (((uint64_t) ev_set->address[i] & ~0xFFFULL) | offset));
     }
-    return i;
+    return shifted;
 }
 
-bool test_evset(uint64_t *victim, struct eviction_set_t *ev_set){
-    uint64_t t_probe = 0;
-    // Filter measurements that are not plausible
-    while(t_probe < 30 || t_probe > 400){
-        // Access the victim address
-        asm volatile("movq (%0), %%rax\n" : : "r"(victim) : "rax");
+/**
+ * @brief Builds eviction sets for all 64 lines of a victim page at the victim's offset: one construction for 
+ * the victim line, the sets of the other lines are derived with shift_evset and verified. Only offsets whose 
+ * derived set fails are scanned. The kernels store to the victims, so the family uses its own zeroed page 
+ * instead of the page of the (heap allocated) victim.
+ */
+void build_page_family(struct candidate_pool_t* pool, uint64_t* victim){
+    uint64_t start = now_ns();
+    uint64_t tests_before = test_ctr;
+    int victim_offset = (uint64_t) victim & 0xFC0;
+    int derived = 0, scanned = 0, failed = 0;
+    bool success;
 
-        // We access the eviction set addresses multiple times to make sure that they really are cached
-        struct eviction_set_t *current = ev_set;
-        struct eviction_set_t *prev = ev_set;
-        while(current->next != NULL){
-            // Access the current and the previous ev-address
-            asm volatile("movq (%0), %%rax\n" : : "r"(current->address) : "rax");
-            asm volatile("movq (%0), %%rax\n" : : "r"(prev->address) : "rax");
-            prev = current;
-            current = current->next;
+    uint8_t *victim_page = aligned_alloc(0x1000, 0x1000);
+    memset(victim_page, 0, 0x1000);
+    victim = (uint64_t*) (victim_page + victim_offset);
+    init_candidate_pool(pool, victim);
+
+    struct eviction_set_t *ev_set = build_evset(pool, victim, &success);
+    if(!success){
+        printf("Eviction set construction for the victim failed\n");
+        free(victim_page);
+        return;
+    }
+    uint64_t build_ns = now_ns() - start;
+    for(int offset = 0; offset < 0x1000; offset += 64){
+        if(offset == victim_offset){
+            continue;
         }
-        // Second iteration to REALLY make sure the victim was replaced if it collides...
-        current = ev_set;
-        while(current->next != NULL){
-            asm volatile("movq (%0), %%rax\n" : : "r"(current->address) : "rax");
-            current = current->next;
+        uint64_t *line = (uint64_t*) (victim_page + offset);
+        if(test_evset(line, shift_evset(ev_set, offset))){
+            derived++;
+            continue;
         }
+        // Fall back to scanning the pool at this offset
+        struct candidate_pool_t slice = *pool;
+        init_candidate_pool(&slice, line);
+        build_evset(&slice, line, &success);
+        scanned++;
+        if(!success){
+            failed++;
+        }
+    }
+    double ms = (now_ns() - start) / 1e6;
+    printf("Page family: %d derived, %d scanned, %d failed, %lu test_evset calls\n", derived, scanned, failed, test_ctr - tests_before);
+    printf("Page family took %.3f ms, the first construction %.3f ms\n", ms, build_ns / 1e6);
+    free(victim_page);
+}
 
-        // Measure the access time to the victim
-        asm volatile(
-            "nop\n\t" //alignment
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "rdtscp\n\t"                        // Start measurement
-            "shl $32, %%rdx\n\t"                // combine the timestamp
-            "or %%rdx, %%rax\n\t"
-            "mov %%rax, %%r15\n\t"              // Move the timestamp out of the way
-            "movq (%[victim]), %%rdx\n\t"       // Access the victim address
-            "mfence\n\t"                        // Make sure rtscp isn't executed out of order
-            "nop\n\t"                           // Nops for improved accuracy
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "nop\n\t"
-            "rdtscp\n\t"                        // End the timing measurement
-            "shl $32, %%rdx\n\t"                // Combine the timestamp
-            "or %%rdx, %%rax\n\t"
-            "sub %%r15, %%rax\n\t"              // Compute the difference
-            "mov %%rax, %[out]"
-        : [out]"=r"(t_probe) : [victim]"r"(victim) : "rax", "rbx", "rcx", "rdx", "r15");
-    }
-
-    if (t_probe > CACHE_MISS_THRESHOLD){ // very basic test of whether ev evicts the target.
-        return true;
-    }else{
-        return false;
+/**
+ * @brief Copies an eviction set out of the arena, so the arena can be reset.
+ */
+static struct eviction_set_t copy_evset(struct eviction_set_t* ev_set){
+    struct eviction_set_t copy;
+    copy.address = malloc(ev_set->len * sizeof(uint64_t*));
+    memcpy(copy.address, ev_set->address, ev_set->len * sizeof(uint64_t*));
+    copy.len = ev_set->len;
+    copy.capacity = ev_set->len;
+    return copy;
+}
+
+/**
+ * @brief Adds a congruence class with its eviction set and the colliding candidates of its construction to the map.
+ */
+static void add_llc_class(struct llc_map_t* map, int offset, uint64_t* victim, struct eviction_set_t* ev_set, 
+        struct eviction_set_t* collisions){
+    if(map->classes == map->capacity){
+        map->capacity = map->capacity ? 2 * map->capacity : 64;
+        map->class = realloc(map->class, map->capacity * sizeof(struct llc_class_t));
+    }
+    struct llc_class_t *c = &map->class[map->classes++];
+    c->offset = offset;
+    c->victim = victim;
+    c->ev_set = copy_evset(ev_set);
+    c->collisions = copy_evset(collisions);
+}
+
+/**
+ * @brief Returns true if the address is a member of an eviction set of the classes from first_class on.
+ */
+static bool is_llc_class_member(struct llc_map_t* map, int first_class, uint64_t* address){
+    for(int i = first_class; i < map->classes; i++){
+        for(int j = 0; j < map->class[i].ev_set.len; j++){
+            if(map->class[i].ev_set.address[j] == address){
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Returns the class at the given page offset whose eviction set evicts the address, -1 if there is none.
+ * 
+ * @param first_class -> the first class of the offset, the classes of an offset are stored consecutively
+ */
+static int find_llc_class(struct llc_map_t* map, int first_class, uint64_t* address){
+    for(int i = first_class; i < map->classes; i++){
+        if(test_evset(address, &map->class[i].ev_set)){
+            return i;
+        }
     }
+    return -1;
 }
 
+/**
+ * @brief Maps the LLC: builds eviction sets for all 64 line offsets of a page and for every set and slice
+ * reachable from the candidate pool. The victims are the lines of MAP_VICTIM_PAGES scratch pages. A victim 
+ * that an eviction set of its offset already evicts is congruent to a known class and skipped, so every 
+ * class is only constructed once. The victims that founded a class at the previous offset are tried first, 
+ * they likely lie in different classes again. A victim whose page is congruent to a class at an earlier offset
+ * first tries the eviction set derived from that class, see shift_evset. If that fails, the colliding candidates 
+ * of the class's construction, shifted to the new offset, are scanned before the pool. Their pages match the 
+ * set index bits of the victim's page. Coverage is estimated with MAP_COVERAGE_SAMPLES pool candidates per 
+ * offset, members of the eviction sets are not sampled.
+ */
+void build_llc_map(struct candidate_pool_t* pool){
+    struct llc_map_t map = {NULL, 0, 0};
+    uint8_t *victim_pages = aligned_alloc(0x1000, MAP_VICTIM_PAGES * 0x1000);
+    int order[MAP_VICTIM_PAGES];
+    int page_class[MAP_VICTIM_PAGES]; // Class of the victim page at the last offset, -1 if unknown
+    uint64_t builds = 0, skipped = 0, failures = 0, derived = 0, seeded = 0;
+    uint64_t covered = 0, sampled = 0;
+    uint64_t start = now_ns();
 
+    memset(victim_pages, 0, MAP_VICTIM_PAGES * 0x1000);
+    for(int i = 0; i < MAP_VICTIM_PAGES; i++){
+        order[i] = i;
+        page_class[i] = -1;
+    }
 
-void print_evset(struct eviction_set_t* ev_set, uint64_t* victim){
-    struct eviction_set_t *current = ev_set;
-    int i = 0;
+    for(int offset = 0; offset < 0x1000; offset += 64){
+        int first_class = map.classes;
+        int failed_in_row = 0;
+        int next_founders = 0;
+        uint64_t offset_start = now_ns();
+        for(int i = 0; i < MAP_VICTIM_PAGES && failed_in_row < MAP_MAX_FAILURES; i++){
+            uint64_t *victim = (uint64_t*) (victim_pages + order[i] * 0x1000 + offset);
+            int known = find_llc_class(&map, first_class, victim);
+            if(known != -1){
+                page_class[order[i]] = known;
+                skipped++;
+                continue;
+            }
+            bool success = false;
+            struct eviction_set_t *ev_set = NULL;
+            struct eviction_set_t *collisions = new_evset(EVSET_INITIAL_CAPACITY);
+            struct candidate_queue_t seeds = {NULL, 0};
+            if(page_class[order[i]] != -1){
+                // The page was congruent to a class at an earlier offset, try the derived set first
+                struct llc_class_t *earlier = &map.class[page_class[order[i]]];
+                ev_set = shift_evset(&earlier->ev_set, offset);
+                success = test_evset(victim, ev_set);
+                derived += success;
+                // Otherwise seed the construction with the shifted colliding candidates of that class
+                struct eviction_set_t *shifted = shift_evset(&earlier->collisions, offset);
+                seeds.candidates = (void**) shifted->address;
+                seeds.len = shifted->len < MAP_MAX_SEEDS ? shifted->len : MAP_MAX_SEEDS;
+            }
+            if(!success){
+                struct candidate_pool_t slice = *pool;
+                init_candidate_pool(&slice, victim);
+                ev_set = build_evset_from(&slice, victim, &seeds, true, collisions, &success);
+                builds++;
+                seeded += seeds.len;
+            }
+            if(success){
+                page_class[order[i]] = map.classes;
+                add_llc_class(&map, offset, victim, ev_set, collisions);
+                // Founders go to the front of the order for the next offset
+                int tmp = order[next_founders];
+                order[next_founders] = order[i];
+                order[i] = tmp;
+                next_founders++;
+                failed_in_row = 0;
+            }else{
+                failures++;
+                failed_in_row++;
+            }
+            reset_evset_arena();
+        }
 
-    printf("-----------  EV SET  -----------\n");
+        // Estimate the fraction of pool candidates at this offset that belong to a found class
+        struct candidate_pool_t slice = *pool;
+        init_candidate_pool(&slice, (uint64_t*) (victim_pages + offset));
+        uint64_t step = slice.count / MAP_COVERAGE_SAMPLES + 1;
+        uint64_t offset_covered = 0, offset_sampled = 0;
+        for(uint64_t c = 0; c < slice.count; c += step){
+            // A member of an eviction set always hits its own set
+            if(is_llc_class_member(&map, first_class, get_candidate(&slice, c))){
+                continue;
+            }
+            if(find_llc_class(&map, first_class, get_candidate(&slice, c)) != -1){
+                offset_covered++;
+            }
+            offset_sampled++;
+        }
+        covered += offset_covered;
+        sampled += offset_sampled;
+        printf("Offset 0x%03x: %3d classes, %5.1f%% of the pool covered, %lu ms\n", offset, map.classes - first_class, 
+            offset_sampled ? 100.0 * offset_covered / offset_sampled : 0, (now_ns() - offset_start) / 1000000);
+    }
 
+    double sec = (now_ns() - start) / 1e9;
+    printf("LLC map: %d classes, %lu derived, %lu constructions, %lu victims in known classes, %lu failed constructions\n", 
+        map.classes, derived, builds, skipped, failures);
+    printf("Seeds: %lu colliding candidates of earlier offsets scanned first\n", seeded);
+    printf("Coverage: %.1f%% of the sampled pool candidates, build time %.3f s\n", sampled ? 100.0 * covered / sampled : 0, sec);
     #if defined(USE_LIBTEA) || defined(VERIFY)
-    size_t paddr = libtea_get_physical_address(instance, (size_t)victim);
-    int set = libtea_get_cache_set(instance, paddr);
-    int slice = libtea_get_cache_slice(instance, paddr);
-    printf("Victim: %p\t Cache Set: %4d, Cache Slice: %d\n\n", (void*) paddr, set, slice);
+    for(int i = 0; i < map.classes; i++){
+        size_t paddr = libtea_get_physical_address(instance, (size_t) map.class[i].victim);
+        printf("Offset 0x%03x, Cache Set: %4d, Cache Slice: %d\n", map.class[i].offset, 
+            libtea_get_cache_set(instance, paddr), libtea_get_cache_slice(instance, paddr));
+    }
     #endif
 
+    for(int i = 0; i < map.classes; i++){
+        free(map.class[i].ev_set.address);
+        free(map.class[i].collisions.address);
+    }
+    free(map.class);
+    free(victim_pages);
+}
 
-    while(current->next != NULL){
-        #if defined(USE_LIBTEA) || defined(VERIFY)
-        paddr = libtea_get_physical_address(instance, (size_t)current->address);
-        set = libtea_get_cache_set(instance, paddr);
-        slice = libtea_get_cache_slice(instance, paddr);
-        printf("    %2d: %p\t Cache Set: %4d, Cache Slice: %d\n", i, (void*) paddr, set, slice);
-        #else
-        printf("    %2d: %p\n", i, current->address);
-        #endif
-        ++i;
-        current = current->next;
+/**
+ * @brief Partitions all candidates of the pool into congruence classes (same LLC set and slice). The first 
+ * unassigned candidate is the victim of the next construction, which only scans the unassigned candidates. 
+ * The members of the new minimal eviction set are assigned directly, every other unassigned candidate is 
+ * tested against the set. The index stores the class of every candidate and one eviction set per class.
+ */
+void partition_pool(struct candidate_pool_t* pool, struct congruence_index_t* index){
+    int failed_in_row = 0;
+    uint64_t assigned = 0;
+    struct candidate_queue_t unassigned;
+    unassigned.candidates = malloc(pool->count * sizeof(void*));
+
+    index->pool = *pool;
+    index->class_of = calloc(pool->count, sizeof(uint16_t));
+    index->sets = NULL;
+    index->class_size = NULL;
+    index->classes = 0;
+    index->capacity = 0;
+
+    for(uint64_t v = 0; v < pool->count && failed_in_row < PARTITION_MAX_FAILURES; v++){
+        if(index->class_of[v] != PARTITION_UNASSIGNED){
+            continue;
+        }
+        if(index->classes == PARTITION_MAX_CLASSES){
+            break;
+        }
+        uint64_t *victim = get_candidate(pool, v);
+        bool success;
+        // The candidates before the victim are all assigned or unassignable
+        unassigned.len = 0;
+        for(uint64_t c = v + 1; c < pool->count; c++){
+            if(index->class_of[c] == PARTITION_UNASSIGNED){
+                unassigned.candidates[unassigned.len++] = get_candidate(pool, c);
+            }
+        }
+        struct eviction_set_t *ev_set = build_evset_from(pool, victim, &unassigned, false, NULL, &success);
+        if(!success){
+            index->class_of[v] = PARTITION_UNASSIGNABLE;
+            failed_in_row++;
+            reset_evset_arena();
+            continue;
+        }
+        failed_in_row = 0;
+        if(index->classes == index->capacity){
+            index->capacity = index->capacity ? 2 * index->capacity : 64;
+            index->sets = realloc(index->sets, index->capacity * sizeof(struct eviction_set_t));
+            index->class_size = realloc(index->class_size, index->capacity * sizeof(uint64_t));
+        }
+        int class = index->classes++;
+        index->sets[class] = copy_evset(ev_set);
+        index->class_size[class] = 0;
+        reset_evset_arena();
+
+        // Assign the victim and the members of the set, a test against their own set would always hit
+        index->class_of[v] = class + 1;
+        index->class_size[class]++;
+        for(int i = 0; i < index->sets[class].len; i++){
+            index->class_of[((uint8_t*) index->sets[class].address[i] - pool->first) / pool->stride] = class + 1;
+            index->class_size[class]++;
+        }
+        // Then every other unassigned candidate the eviction set evicts
+        for(uint64_t i = 0; i < unassigned.len; i++){
+            uint64_t c = ((uint8_t*) unassigned.candidates[i] - pool->first) / pool->stride;
+            if(index->class_of[c] == PARTITION_UNASSIGNED && test_evset(unassigned.candidates[i], &index->sets[class])){
+                index->class_of[c] = class + 1;
+                index->class_size[class]++;
+            }
+        }
+        assigned += index->class_size[class];
+        if(verbose){
+            printf("Class %4d: %6lu candidates, %lu of %lu assigned\n", class, index->class_size[class], assigned, pool->count);
+        }
     }
+    free(unassigned.candidates);
 }
 
-void calibrate(uint64_t *victim){
-    printf("Hit / Miss stats\n");
-    uint64_t t_probe;
-    asm volatile("clflush (%0)\n\t"::"r"(victim):);
-    // Measure the access time to the victim
-    asm volatile(
-        "nop\n\t" //alignment
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "rdtscp\n\t"                        // Start measurement
-        "shl $32, %%rdx\n\t"                // combine the timestamp
-        "or %%rdx, %%rax\n\t"
-        "mov %%rax, %%r15\n\t"              // Move the timestamp out of the way
-        "movq (%[victim]), %%rdx\n\t"       // Access the victim address
-        "mfence\n\t"                        // Make sure rtscp isn't executed out of order
-        "nop\n\t"                           // Nops for improved accuracy
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "rdtscp\n\t"                        // End the timing measurement
-        "shl $32, %%rdx\n\t"                // Combine the timestamp
-        "or %%rdx, %%rax\n\t"
-        "sub %%r15, %%rax\n\t"              // Compute the difference
-        "mov %%rax, %[out]"
-    : [out]"=r"(t_probe) : [victim]"r"(victim) : "rax", "rbx", "rcx", "rdx", "r15");
-    printf("Miss: %lu\n", t_probe);
-
-    asm volatile(
-        "nop\n\t" //alignment
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "rdtscp\n\t"                        // Start measurement
-        "shl $32, %%rdx\n\t"                // combine the timestamp
-        "or %%rdx, %%rax\n\t"
-        "mov %%rax, %%r15\n\t"              // Move the timestamp out of the way
-        "movq (%[victim]), %%rdx\n\t"       // Access the victim address
-        "mfence\n\t"                        // Make sure rtscp isn't executed out of order
-        "nop\n\t"                           // Nops for improved accuracy
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "rdtscp\n\t"                        // End the timing measurement
-        "shl $32, %%rdx\n\t"                // Combine the timestamp
-        "or %%rdx, %%rax\n\t"
-        "sub %%r15, %%rax\n\t"              // Compute the difference
-        "mov %%rax, %[out]"
-    : [out]"=r"(t_probe) : [victim]"r"(victim) : "rax", "rbx", "rcx", "rdx", "r15");
-    
-    printf("Hit: %lu\n", t_probe);
-
-    asm volatile(
-        "nop\n\t" //alignment
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "rdtscp\n\t"                        // Start measurement
-        "shl $32, %%rdx\n\t"                // combine the timestamp
-        "or %%rdx, %%rax\n\t"
-        "mov %%rax, %%r15\n\t"              // Move the timestamp out of the way
-        "movq (%[victim]), %%rdx\n\t"       // Access the victim address
-        "mfence\n\t"                        // Make sure rtscp isn't executed out of order
-        "nop\n\t"                           // Nops for improved accuracy
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "rdtscp\n\t"                        // End the timing measurement
-        "shl $32, %%rdx\n\t"                // Combine the timestamp
-        "or %%rdx, %%rax\n\t"
-        "sub %%r15, %%rax\n\t"              // Compute the difference
-        "mov %%rax, %[out]"
-    : [out]"=r"(t_probe) : [victim]"r"(victim) : "rax", "rbx", "rcx", "rdx", "r15");
-    printf("Hit: %lu\n", t_probe);
-    asm volatile("mfence");
-    asm volatile("clflush (%0)\n\t"::"r"(victim):);
-    // Measure the access time to the victim
-    asm volatile(
-        "nop\n\t" //alignment
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "rdtscp\n\t"                        // Start measurement
-        "shl $32, %%rdx\n\t"                // combine the timestamp
-        "or %%rdx, %%rax\n\t"
-        "mov %%rax, %%r15\n\t"              // Move the timestamp out of the way
-        "movq (%[victim]), %%rdx\n\t"       // Access the victim address
-        "mfence\n\t"
-        "cpuid\n\t"                        // Make sure rtscp isn't executed out of order
-        "nop\n\t"                           // Nops for improved accuracy
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "nop\n\t"
-        "rdtscp\n\t"                        // End the timing measurement
-        "shl $32, %%rdx\n\t"                // Combine the timestamp
-        "or %%rdx, %%rax\n\t"
-        "sub %%r15, %%rax\n\t"              // Compute the difference
-        "mov %%rax, %[out]"
-    : [out]"=r"(t_probe) : [victim]"r"(victim) : "rax", "rbx", "rcx", "rdx", "r15");
-    printf("Miss: %lu\n", t_probe);
+/**
+ * @brief Returns the congruence class of the target, -1 if it is unknown. Targets in the pool are looked up in 
+ * the index and verified with one test_evset, other targets are tested against the classes.
+ */
+int lookup_congruence_class(struct congruence_index_t* index, uint64_t* target){
+    struct candidate_pool_t *pool = &index->pool;
+    uint64_t distance = (uint8_t*) target - pool->first;
+    if((uint8_t*) target >= pool->first && distance % pool->stride == 0 && distance / pool->stride < pool->count){
+        int class = index->class_of[distance / pool->stride] - 1;
+        if(class >= 0 && class < index->classes && test_evset(target, &index->sets[class])){
+            return class;
+        }
+        return -1;
+    }
+    for(int class = 0; class < index->classes; class++){
+        if(test_evset(target, &index->sets[class])){
+            return class;
+        }
+    }
+    return -1;
 }
 
+/**
+ * @brief Partitions the pool and prints the partition time, a histogram of the class sizes, the memory 
+ * overhead of the index and the lookup time for PARTITION_LOOKUPS random pool candidates.
+ */
+void run_partition(struct candidate_pool_t* pool){
+    struct congruence_index_t index;
+    uint64_t start = now_ns();
+    partition_pool(pool, &index);
+    double sec = (now_ns() - start) / 1e9;
 
-#if defined(USE_LIBTEA) || defined(VERIFY)
-void setup_libtea(){
-    instance = libtea_init();
-    if (!instance){
-        printf("Libtea initialization failed\n");
+    uint64_t assigned = 0, unassignable = 0;
+    for(uint64_t c = 0; c < pool->count; c++){
+        if(index.class_of[c] == PARTITION_UNASSIGNABLE){
+            unassignable++;
+        }else if(index.class_of[c] != PARTITION_UNASSIGNED){
+            assigned++;
+        }
+    }
+    printf("Partition: %d classes, %lu of %lu candidates assigned, %lu failed victims, %.3f s\n", 
+        index.classes, assigned, pool->count, unassignable, sec);
+
+    // Class sizes in power of two bins
+    uint64_t hist[PARTITION_HIST_BINS] = {0};
+    for(int class = 0; class < index.classes; class++){
+        int bin = 0;
+        while(bin < PARTITION_HIST_BINS - 1 && (2ULL << bin) <= index.class_size[class]){
+            bin++;
+        }
+        hist[bin]++;
+    }
+    printf("Class sizes:");
+    for(int bin = 0; bin < PARTITION_HIST_BINS; bin++){
+        if(hist[bin] == 0){
+            continue;
+        }
+        if(bin == PARTITION_HIST_BINS - 1){
+            printf(" >=%llu: %lu", 1ULL << bin, hist[bin]);
+        }else{
+            printf(" %llu-%llu: %lu", 1ULL << bin, (2ULL << bin) - 1, hist[bin]);
+        }
+    }
+    printf("\n");
+
+    uint64_t index_bytes = pool->count * sizeof(uint16_t) + index.capacity * (sizeof(struct eviction_set_t) + sizeof(uint64_t));
+    for(int class = 0; class < index.classes; class++){
+        index_bytes += index.sets[class].len * sizeof(uint64_t*);
+    }
+    printf("Index: %.1f KB, %.2f bytes per candidate\n", index_bytes / 1024.0, index_bytes / (double) pool->count);
+
+    // Lookups of random pool candidates
+    if(index.classes > 0){
+        int found = 0;
+        uint64_t lookup_start = now_ns();
+        for(int i = 0; i < PARTITION_LOOKUPS; i++){
+            if(lookup_congruence_class(&index, get_candidate(pool, rand() % pool->count)) != -1){
+                found++;
+            }
+        }
+        printf("Lookups: %d of %d verified, %.1f us per lookup\n", found, PARTITION_LOOKUPS, 
+            (now_ns() - lookup_start) / 1e3 / PARTITION_LOOKUPS);
+    }
+
+    for(int class = 0; class < index.classes; class++){
+        free(index.sets[class].address);
     }
+    free(index.sets);
+    free(index.class_size);
+    free(index.class_of);
 }
-#endif
 
-int main(){
+/**
+ * @brief Returns the number of physical cores among the online CPUs that share cache index of cpu0, 0 on failure.
+ * Unlike get_physical_cores, this does not depend on the affinity mask and stays within one package.
+ */
+static int count_cache_cores(int index){
+    cpu_set_t shared, online;
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/shared_cpu_list", index);
+    if(!read_sysfs_cpu_list(path, &shared) || !read_sysfs_cpu_list("/sys/devices/system/cpu/online", &online)){
+        return 0;
+    }
+    CPU_AND(&shared, &shared, &online);
+    long core_id[CPU_SETSIZE];
+    int n = 0;
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+        if(!CPU_ISSET(cpu, &shared)){
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        long core = read_sysfs_long(path);
+        if(core < 0){
+            core = cpu;
+        }
+        bool sibling = false;
+        for(int i = 0; i < n; i++){
+            if(core_id[i] == core){
+                sibling = true;
+                break;
+            }
+        }
+        if(!sibling){
+            core_id[n++] = core;
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Detects the last level cache of the CPU the program runs on: from the deterministic cache parameters 
+ * (CPUID leaf 4 on Intel, leaf 0x8000001D on AMD) or, if these are not available, from 
+ * /sys/devices/system/cpu/cpu0/cache. The number of slices is not reported by the CPU, we assume one slice per 
+ * physical core that shares the LLC with cpu0. If the detection fails, CACHE_ASSOC and LLC_SET_MASK are used. 
+ * CPUID leaf 0x18 only describes the TLBs, it does not help here.
+ */
+void detect_llc(){
+    unsigned int eax, ebx, ecx, edx;
+    int best_level = 0;
+    uint64_t ways = 0, sets = 0, line = 0;
+
+    // Deterministic cache parameters, the highest cache level is the LLC
+    unsigned int leaf = 0;
+    if(__get_cpuid(0, &eax, &ebx, &ecx, &edx)){
+        if(ebx == 0x756e6547 && eax >= 4){ // "Genu"ineIntel
+            leaf = 4;
+        }else if(ebx == 0x68747541 && __get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx) && (ecx & (1 << 22))){ // "Auth"enticAMD, TopologyExtensions
+            leaf = 0x8000001D;
+        }
+    }
+    for(unsigned int i = 0; leaf != 0 && i < 16; i++){
+        __cpuid_count(leaf, i, eax, ebx, ecx, edx);
+        int type = eax & 0x1F;
+        int level = (eax >> 5) & 0x7;
+        if(type == 0){
+            break;
+        }
+        if(type != 2 && level > best_level){ // Data or unified cache
+            best_level = level;
+            ways = ((ebx >> 22) & 0x3FF) + 1;
+            line = (ebx & 0xFFF) + 1;
+            sets = (uint64_t) ecx + 1;
+            llc.source = "cpuid";
+        }
+    }
+
+    // Fall back to sysfs. All indices are scanned, the highest level is the LLC. Its index also lists the CPUs 
+    // that share it, so it is looked up even if CPUID described the geometry.
+    bool from_cpuid = best_level != 0;
+    int llc_index = -1, index_level = 0;
+    for(int i = 0; i < 16; i++){
+        char path[128];
+        char type[16] = "";
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", i);
+        long level = read_sysfs_long(path);
+        if(level < 0){
+            break;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", i);
+        FILE *f = fopen(path, "r");
+        if(f){
+            if(fscanf(f, "%15s", type) != 1){
+                type[0] = 0;
+            }
+            fclose(f);
+        }
+        if(level <= index_level || strcmp(type, "Instruction") == 0){
+            continue;
+        }
+        index_level = level;
+        llc_index = i;
+        if(from_cpuid){
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/ways_of_associativity", i);
+        long w = read_sysfs_long(path);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/number_of_sets", i);
+        long n = read_sysfs_long(path);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/coherency_line_size", i);
+        long l = read_sysfs_long(path);
+        if(w > 0 && n > 0 && l > 0){
+            best_level = level;
+            ways = w;
+            sets = n;
+            line = l;
+            llc.source = "sysfs";
+        }
+    }
+
+    if(best_level == 0 || line != 64){
+        llc.source = "defaults";
+        printf("LLC: detection failed, using %d ways and set mask 0x%lx\n", llc.assoc, llc.set_mask);
+        return;
+    }
+
+    // Slice heuristic: one slice per physical core that shares the LLC. The sets of a slice must be a power of two, 
+    // otherwise we assume the largest power of two up to LLC_MAX_SLICE_SETS that divides the number of sets.
+    int slices = llc_index >= 0 && index_level == best_level ? count_cache_cores(llc_index) : 0;
+    if(slices <= 0){
+        slices = 1;
+    }
+    uint64_t slice_sets = sets / slices;
+    if(sets % slices != 0 || (slice_sets & (slice_sets - 1)) != 0){
+        slice_sets = sets & -sets;
+        if(slice_sets > LLC_MAX_SLICE_SETS){
+            slice_sets = LLC_MAX_SLICE_SETS;
+        }
+        slices = sets / slice_sets;
+    }
+    llc.assoc = ways;
+    llc.sets = sets;
+    llc.line_size = line;
+    llc.slices = slices;
+    llc.size = ways * sets * line;
+    llc.set_mask = (slice_sets - 1) * line;
+    printf("LLC: %lu KB, %d ways, %lu sets, %d slices, set mask 0x%lx (%s)\n", llc.size / 1024, llc.assoc, llc.sets, 
+        llc.slices, llc.set_mask, llc.source);
+}
+
+int main(int argc, char** argv){
+    long deadline_ms = 0;
+    uint64_t batch_victims = 0;
+    int batch_threads = 0;
+    bool llc_map = false;
+    bool page_family = false;
+    bool partition = false;
+    bool autotune = false;
+    bool force_counter = false;
+    int store = STORE_MOV;
     srand(time(NULL));
 
+    int opt;
+    while((opt = getopt(argc, argv, "acd:jk:mps:t:v:w:")) != -1){
+        switch(opt){
+            case 'd':
+                deadline_ms = atol(optarg);
+                break;
+            case 't':
+                batch_threads = atoi(optarg);
+                break;
+            case 'v':
+                batch_victims = strtoull(optarg, NULL, 10);
+                break;
+            case 'm':
+                llc_map = true;
+                break;
+            case 'a':
+                page_family = true;
+                break;
+            case 'p':
+                partition = true;
+                break;
+            case 's':
+                serialization = parse_serialization(optarg);
+                if(serialization < 0){
+                    printf("Unknown serialization %s, use cpuid, lfence, mfence or serialize\n", optarg);
+                    exit(1);
+                }
+                if(serialization == SERIALIZE_INSTR && !serialize_supported()){
+                    printf("The CPU does not support the serialize instruction\n");
+                    exit(1);
+                }
+                break;
+            case 'c':
+                force_counter = true;
+                break;
+            case 'j':
+                autotune = true;
+                break;
+            case 'w':
+                store = parse_store(optarg);
+                if(store < 0){
+                    printf("Unknown store %s, use mov, movnti, avx, avx512, rep or repeat\n", optarg);
+                    exit(1);
+                }
+                if(!store_supported(store)){
+                    printf("The CPU does not support the %s store\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'k':
+                group_size = atoi(optarg);
+                if(group_size < 1 || group_size > GROUP_SIZE_MAX){
+                    printf("The group size must be between 1 and %d\n", GROUP_SIZE_MAX);
+                    exit(1);
+                }
+                break;
+            default:
+                printf("Usage: %s [-k group size] [-s cpuid|lfence|mfence|serialize] [-j] [-c] [-w mov|movnti|avx|avx512|rep|repeat] [-d deadline in ms] [-v batch victims] [-t batch threads] [-m] [-a] [-p]\n", argv[0]);
+                exit(1);
+        }
+    }
+
+    detect_llc();
+    select_timer(force_counter);
+    if(store != STORE_MOV){
+        struct kernel_config_t config = {serialization, 16, 11, 0, true, store};
+        install_kernel(&config);
+    }
+
     #if defined(USE_LIBTEA) || defined(VERIFY)
     if(geteuid() != 0)
     {
@@ -605,34 +3391,143 @@ int main(){
     }
 
     setup_libtea();    
-    instance->llc_set_mask =  65472;
-    instance->llc_slices = 8;
+    instance->llc_set_mask = llc.set_mask;
+    instance->llc_slices = llc.slices;
     printf("Sets: %d, Slices %d\n", instance->llc_sets, instance->llc_slices);
     #endif // USE_LIBTEA
 
     // Allocate the array in which eviction set addresses are searched
-    uint64_t addr_space_size = MEM_SIZE;
-    uint64_t* addr_space = (uint64_t*) malloc(addr_space_size*sizeof(uint64_t));
-    addr_space[0] = 0;
+    struct candidate_pool_t pool;
+    #ifdef PREFAULT_POOL
+    struct timespec setup_start, setup_end;
+    struct rusage usage_before, usage_after;
+    clock_gettime(CLOCK_MONOTONIC, &setup_start);
+    getrusage(RUSAGE_SELF, &usage_before);
+    #endif // PREFAULT_POOL
+    if(!alloc_candidate_pool(&pool, MEM_SIZE*sizeof(uint64_t))){
+        exit(1);
+    }
+    #ifdef PREFAULT_POOL
+    #ifndef SPARSE_POOL
+    prefault_candidate_pool(&pool);
+    #endif // SPARSE_POOL
+    getrusage(RUSAGE_SELF, &usage_after);
+    clock_gettime(CLOCK_MONOTONIC, &setup_end);
+    long setup_msec = (setup_end.tv_sec - setup_start.tv_sec) * 1000 + (setup_end.tv_nsec - setup_start.tv_nsec) / 1000000;
+    printf("Pool setup took %ld seconds %ld milliseconds, %ld minor faults, %ld major faults\n", setup_msec/1000, setup_msec%1000, 
+        usage_after.ru_minflt - usage_before.ru_minflt, usage_after.ru_majflt - usage_before.ru_majflt);
+    #endif // PREFAULT_POOL
     
-    // Select a random target address.
-    uint64_t* victim = (uint64_t*) malloc(8);
+    // Select a random target address. It owns its cache line, the line-wide stores write all of it.
+    uint64_t* victim = (uint64_t*) aligned_alloc(64, 64);
     victim[0] = 0;
-    calibrate(victim);
+    calibrate(victim, NULL);
+
+    init_candidate_pool(&pool, victim);
+    printf("Candidates: %lu, %.1f per MB\n", pool.count, pool.count / (pool.size / (1024.0*1024.0)));
+
+    if(autotune){
+        autotune_kernel(&pool, victim, store);
+    }
+
+    #ifdef CLASSIFY_BENCH
+    bench_classification(&pool, victim);
+    free_candidate_pool(&pool);
+    free(victim);
+    return 0;
+    #endif // CLASSIFY_BENCH
+
+    #ifdef STORE_BENCH
+    bench_stores(&pool, victim);
+    free_candidate_pool(&pool);
+    free(victim);
+    return 0;
+    #endif // STORE_BENCH
+
+    #ifdef TIMER_BENCH
+    bench_timers(victim);
+    free_candidate_pool(&pool);
+    free(victim);
+    return 0;
+    #endif // TIMER_BENCH
+
+    #ifdef SERIALIZATION_BENCH
+    bench_serialization(&pool, victim);
+    free_candidate_pool(&pool);
+    free(victim);
+    return 0;
+    #endif // SERIALIZATION_BENCH
+
+    if(llc_map){
+        #ifdef SPARSE_POOL
+        printf("The LLC map does not support SPARSE_POOL\n");
+        #else
+        verbose = false;
+        build_llc_map(&pool);
+        #endif // SPARSE_POOL
+        free_candidate_pool(&pool);
+        free(victim);
+        return 0;
+    }
+
+    if(partition){
+        #ifdef SPARSE_POOL
+        printf("The partition does not support SPARSE_POOL\n");
+        #else
+        verbose = false;
+        run_partition(&pool);
+        #endif // SPARSE_POOL
+        free_candidate_pool(&pool);
+        free(victim);
+        return 0;
+    }
+
+    if(page_family){
+        #ifdef SPARSE_POOL
+        printf("The page family does not support SPARSE_POOL\n");
+        #else
+        build_page_family(&pool, victim);
+        #endif // SPARSE_POOL
+        free_candidate_pool(&pool);
+        free(victim);
+        return 0;
+    }
+
+    if(batch_victims > 0){
+        #ifdef SPARSE_POOL
+        printf("The batch mode does not support SPARSE_POOL\n");
+        (void) batch_threads;
+        #else
+        if(timer == TIMER_COUNTING_THREAD){
+            printf("The batch mode does not support the counting thread, it needs all cores\n");
+        }else{
+            run_batch(&pool, batch_victims, batch_threads);
+        }
+        #endif // SPARSE_POOL
+        free_candidate_pool(&pool);
+        free(victim);
+        return 0;
+    }
 
     // Start eviction set construction
     struct eviction_set_t *ev_set = NULL;
+    if(deadline_ms > 0){
+        calibrate_test_cost(victim);
+        deadline_ns = now_ns() + deadline_ms * 1000000ULL;
+    }
     
     #ifndef TRY_UNTIL_SUCCESS
-    ev_set = get_evset(addr_space, victim, addr_space_size);
+    ev_set = get_evset(&pool, victim, NULL, 0, pool.count);
 
     // If the eviction set is valid, reduce it to minimal eviction set. 
     // Make sure you adjusted the cache miss threshold for this to work.
     if (test_evset(victim, ev_set)){
         clock_t before = clock();
 
-        if (reduce_evset(victim, &ev_set)){
+        if (reduce_evset(victim, ev_set, 0)){
             printf("Reduction was successfull\n");
+        }else if(deadline_passed()){
+            print_best_effort(victim, ev_set);
         }else{
             printf("Reduction algorithm failed\n");
         }
@@ -643,26 +3538,26 @@ int main(){
         msec/1000, msec%1000);
     }else{
         printf("The obtained eviction set is too small...\n");
+        if(deadline_passed()){
+            print_best_effort(victim, ev_set);
+        }
     }
     #else
     clock_t before = clock();
-    for(int i = 0; i < addr_space_size-100*4096; i+=100*4096){
-        struct eviction_set_t *res = get_evset(addr_space+i, victim, 100*4096);
-        merge_evsets(&ev_set, &res);
-        if (test_evset(victim, ev_set)){
-            if (reduce_evset(victim, &ev_set)){
-                printf("Reduction was successfull\n");
-                break;
-            }   
-        }
-    }
+    uint64_t faults_before = get_page_faults();
+    bool success;
+    ev_set = build_evset(&pool, victim, &success);
     clock_t difference = clock() - before;
     long msec = difference * 1000 / CLOCKS_PER_SEC;
     printf("Evset took %ld seconds %ld milliseconds\n",
     msec/1000, msec%1000);
+    printf("Measurements: %lu\n", measurement_ctr);
+    printf("Page faults: %lu\n", get_page_faults() - faults_before);
+    print_outlier_stats();
     #endif //TRY_UNTIL_SUCCESS
     print_evset(ev_set, victim);
-    free(addr_space);
+    print_memory_usage(&pool);
+    free_candidate_pool(&pool);
     free(victim);
     return 0;
 }
\ No newline at end of file
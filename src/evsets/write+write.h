@@ -13,36 +13,462 @@ void setup_libtea();
 #include <stdint.h>
 #include <stdbool.h>
 #include <time.h>
+#include <unistd.h>
 #endif // USE_LIBTEA
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <cpuid.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include "math.h"
 
 
 #define RUNS 10
-#define CACHE_MISS_THRESHOLD 130 // 200 for XEON E-2224G
-#define OUTLIER_THRESHOLD 1400 // 1400 for XEON E-2224G
-#define MEM_SIZE 100000000
-#define CACHE_ASSOC 16
+#define CACHE_MISS_THRESHOLD 130 // 200 for XEON E-2224G, default if calibrate() cannot separate hits and misses
+#define OUTLIER_THRESHOLD 1400 // 1400 for XEON E-2224G, replaced by calibrate()
+#define CALIBRATION_SAMPLES 10000
+#define CALIBRATION_PAGES 1024 // Scratch pages for the Write+Write samples and the calibration pairs
+#define CALIBRATION_MAX_CYCLES 100000 // Histogram range
+#define OUTLIER_PERCENTILE 0.99 // Write+Write samples above this percentile are outliers
+#define CALIBRATION_PAIRS 1000 // Pairs of 2*RUNS Write+Write samples to calibrate the difference threshold
+#define DIFF_SIGMA 3.29 // Difference threshold in standard deviations of the non-colliding differences (0.1% two-sided)
+#define COLLISION_PERCENTILE 0.001 // Percentile of the colliding differences the threshold is centred against
+// calibrate() measures the timer overhead (rdtscp, fences, nops) with the empty kernels and prints the thresholds 
+// also in corrected cycles, which carry over between CPUs. With CORRECTED_THRESHOLDS, the cache miss and outlier 
+// thresholds are the corrected ones below plus the overhead measured on the current CPU.
+//#define CORRECTED_THRESHOLDS
+#define CORRECTED_MISS_THRESHOLD 100 // Cache miss threshold without the timer overhead
+#define CORRECTED_OUTLIER_THRESHOLD 1200 // Outlier threshold without the timer overhead
+#define MEM_SIZE 12500000 // Number of uint64_t elements, every 4 KiB page is one candidate
+#define CHUNK_CANDIDATES 100 // Candidates per get_evset call in TRY_UNTIL_SUCCESS mode
+#define CACHE_ASSOC 16 // Used if the LLC cannot be detected
+#define LLC_SET_MASK 0xFFC0 // Set index bits of the LLC (within a slice), used if the LLC cannot be detected
+#define LLC_MAX_SLICE_SETS 2048 // Sets per slice if the number of sets does not fit the core count
+#define DIFF_THRESHOLD 10 // Minimum difference of means for a colliding candidate pair
+
+// Sequential test: stop sampling a candidate pair as soon as the decision is confident. Off by default, it only 
+// pays off if SPRT_EFFECT is large against the noise, check with CLASSIFY_BENCH
+//#define SPRT
+#define SPRT_ALPHA 0.01 // Target false positive rate
+#define SPRT_BETA 0.05 // Target false negative rate
+#define SPRT_EFFECT 15 // Expected difference of means for a colliding candidate in cycles
+#define SPRT_MIN_ROUNDS 1 // Rounds (2 measurements per candidate) before the first decision
+#define SPRT_MAX_RUNS 48 // Upper bound of measurements per candidate pair, independent of RUNS
+
+// Classify every candidate on its own against a non-colliding control address instead of candidate pairs
+//#define REFERENCE_CONTROL
+// Compare the candidates classified per second of the pairwise and the reference-controlled scheme and exit
+//#define CLASSIFY_BENCH
+// Adaptive group testing: write to a group of candidates before the timed victim write and split colliding groups
+//#define GROUP_TESTING
+#define GROUP_SIZE 8 // Default number of candidates per group, can be changed with -k
+#define GROUP_SIZE_MAX 64
+
+// Back the candidate pool with 2 MiB pages and only scan lines that match the victim's full set index
+//#define USE_HUGEPAGES
+#define HUGE_PAGE_SIZE 0x200000ULL
+#define SET_OFFSET_MARGIN 3 // Collisions the victim's set index offset needs ahead of any other offset
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26)
+#endif
+
+// Return the pages of non-colliding candidates to the kernel during the scan, only colliding pages stay resident
+//#define SPARSE_POOL
+#define PAGE_PINNED 0xFFFF
+
+// Fault in and lock the candidate pool before the measurements start. With SPARSE_POOL, the pages are faulted
+// in and locked per chunk right before they are measured. SPARSE_POOL must be defined above this check.
+//#define PREFAULT_POOL
+#define PREFAULT_THREADS 8
+#if defined(PREFAULT_POOL) && !defined(SPARSE_POOL)
+#define POOL_MAP_FLAGS MAP_POPULATE
+#else
+#define POOL_MAP_FLAGS 0
+#endif
+
+// test_evset votes over several probes of the victim
+#define TEST_VOTES 5 // Plausible probes per test
+#define TEST_VOTES_NEEDED 3 // Probes that must miss for the set to evict the victim
+#define TEST_RETRIES 100 // Implausible probes before a test is inconclusive
+#define PROBE_MIN_CYCLES 30 // Probes outside [PROBE_MIN_CYCLES, PROBE_MAX_CYCLES] are implausible
+#define PROBE_MAX_CYCLES 400
+
+#define EVSET_NO_EVICTION 0
+#define EVSET_EVICTS 1
+#define EVSET_INCONCLUSIVE 2
+
+// With a deadline (-d), the scan stops once the estimated reduction time of the found addresses 
+// exhausts the budget, the reduction stops at the deadline and returns the best set so far
+#define DEADLINE_CALIBRATION_TESTS 64
+#define EVICTION_RATE_PROBES 100
+
+// test_evset walks the eviction set through pointers stored in the eviction set lines themselves
+//#define POINTER_CHASE
+
+// Outlier retries per classification and per get_evset scan. Pairs that exceed their budget are 
+// measured again at the end of the scan and dropped if they exceed it again.
+#define PAIR_OUTLIER_BUDGET 64
+#define SCAN_OUTLIER_BUDGET 1000000
+#define OUTLIER_HIST_BINS 8
+
+// Serialization around the timed victim write, selected with -s. cpuid traps to the hypervisor
+// on virtualized hosts, the fence variants do not.
+#define SERIALIZE_CPUID 0 // mfence; cpuid
+#define SERIALIZE_LFENCE 1 // lfence; rdtscp
+#define SERIALIZE_MFENCE_LFENCE 2 // mfence; lfence; rdtscp
+#define SERIALIZE_INSTR 3 // serialize, only if CPUID.(EAX=7,ECX=0):EDX[14] is set
+#define SERIALIZE_VARIANTS 4
+
+// Timer of the kernels. The TSC is replaced by a counting thread on the SMT sibling, as libtea's counting thread 
+// timer, if back-to-back rdtscp take longer than TSC_TRAP_CYCLES (trapped) or the step of the TSC is above 
+// TSC_MAX_RESOLUTION (coarse). -c forces the counting thread. The thresholds that are defined in cycles are then 
+// scaled by the counter ticks per TSC cycle, measured over TIMER_SCALE_NS.
+#define TIMER_TSC 0
+#define TIMER_COUNTING_THREAD 1
+#define TIMERS 2
+#define TIMER_PROBE_SAMPLES 1001
+#define TSC_TRAP_CYCLES 500
+#define TSC_MAX_RESOLUTION 16
+#define TIMER_SCALE_NS 10000000
+//#define TIMER_BENCH // Compares resolution and throughput of both timers and exits
+#define TIMER_BENCH_SAMPLES 100000
+
+struct timer_counter_t{
+    volatile uint64_t value;
+    uint8_t padding[56]; // The counter is alone in its cache line
+} __attribute__((aligned(64)));
+
+// Compares samples per second and the collision / no collision separation of all serialization variants
+//#define SERIALIZATION_BENCH
+#define SERIALIZATION_BENCH_SAMPLES 100000 // Per variant and class
+
+// -j generates the single pair Write+Write kernel at runtime. The generator tries every serialization, 
+// nop padding before both timestamps and alignment of the kernel and keeps the variant with the highest 
+// d'^2 per microsecond between a member of an eviction set and its control address.
+#define KERNEL_CODE_SIZE 0x1000
+#define KERNEL_SLOT_SIZE 0x400
+#define KERNEL_SLOT_KERNEL 0 // Slots of the code page
+#define KERNEL_SLOT_OVERHEAD 1
+#define KERNEL_SLOT_TRIAL 2
+#define KERNEL_TUNE_SAMPLES 2000 // Per variant and class
+#define KERNEL_PRE_NOPS {0, 8, 16, 24} // Before the first rdtscp
+#define KERNEL_POST_NOPS {0, 6, 11, 16} // Before the second rdtscp
+#define KERNEL_ALIGNMENTS {0, 16, 32, 48} // Offset of the kernel in its cache line
+
+// Store instruction of the candidate and the victim write, selected with -w. Every store but STORE_MOV runs in
+// a generated kernel with the default padding (or the one found by -j). The line-wide stores write the whole
+// line of the candidate and the victim. Group tests with more than one candidate keep movq.
+#define STORE_MOV 0 // movq
+#define STORE_MOVNTI 1 // non-temporal movnti
+#define STORE_AVX 2 // 32 byte vmovdqu, needs AVX
+#define STORE_AVX512 3 // 64 byte vmovdqu64, needs AVX-512F
+#define STORE_REP_STOSQ 4 // rep stosq of the whole line
+#define STORE_REPEAT 5 // STORE_REPEAT_COUNT movq to the same line
+#define STORE_VARIANTS 6
+#define STORE_REPEAT_COUNT 4
+//#define STORE_BENCH // Compares the collision effect size of all store variants and exits
+#define STORE_BENCH_SAMPLES 100000 // Per variant and class
+#define STORE_BENCH_SIGMA 3
+
+struct kernel_config_t{
+    int serialization;
+    int pre_nops;
+    int post_nops;
+    int alignment;
+    bool timed_store; // false emits the empty kernel
+    int store;
+};
+
+typedef uint64_t (*write_kernel_t)(uint64_t* victim, void* candidate_0, void* candidate_1, int decision);
+
+#define NO_COLLISION 0
+#define COLLISION_0 1
+#define COLLISION_1 2
+#define PAIR_SKIPPED 3
+
+// Eviction sets are contiguous, cache line aligned arrays allocated from an arena
+#define EVSET_ARENA_SIZE (1ULL << 30) // Reserved virtual memory, only touched pages are backed
+#define EVSET_INITIAL_CAPACITY 64
+
+// The LLC, detected at runtime by detect_llc
+struct llc_info_t{
+  int assoc;
+  uint64_t sets; // All slices
+  uint64_t line_size;
+  int slices;
+  uint64_t size;
+  uint64_t set_mask; // Set index bits within a slice
+  const char *source;
+};
+
+extern struct llc_info_t llc;
+extern uint64_t cache_miss_threshold;
+extern uint64_t outlier_threshold;
+extern int serialization;
+extern write_kernel_t generated_kernel;
+extern int timer;
+extern struct timer_counter_t timer_counter;
+extern write_kernel_t generated_overhead_kernel;
+extern struct kernel_config_t generated_config; // Configuration of the generated kernel, set by install_kernel()
+extern uint64_t load_overhead; // Timer overhead of time_load and measure_write, set by calibrate()
+extern uint64_t write_overhead;
+extern double timer_scale; // Timer ticks per TSC cycle, 1 with the TSC
+extern uint64_t probe_min; // PROBE_MIN_CYCLES and PROBE_MAX_CYCLES in timer ticks
+extern uint64_t probe_max;
+extern double diff_threshold; // DIFF_THRESHOLD and SPRT_EFFECT in timer ticks
+extern double sprt_effect;
+extern double sprt_variance; // Variance of a round of a non-colliding pair, set by calibrate()
 
 struct eviction_set_t{
-  uint64_t *address;
-  struct eviction_set_t *next;
+  uint64_t **address;
+  int len;
+  int capacity;
 }ev_set_t;
 
+struct evset_arena_t{
+  uint8_t *base;
+  uint64_t size;
+  uint64_t used;
+};
+
+extern __thread struct evset_arena_t evset_arena;
+
+struct candidate_queue_t{
+  void **candidates;
+  uint64_t len;
+};
+
+struct outlier_stats_t{
+  uint64_t outliers;
+  uint64_t scan_outliers; // Outliers of the current scan, limited by SCAN_OUTLIER_BUDGET
+  uint64_t classifications;
+  uint64_t skipped; // Classifications that exceeded PAIR_OUTLIER_BUDGET
+  uint64_t dropped; // Candidates that exceeded the budget twice
+  uint64_t hist[OUTLIER_HIST_BINS]; // Classifications by outliers: 0, 1, 2-3, 4-7, ...
+  uint64_t worst; // Most outliers of a single classification
+  void *worst_candidate;
+};
+
+extern __thread struct outlier_stats_t outlier_stats;
+extern __thread uint64_t deadline_ns; // CLOCK_MONOTONIC, 0 without a deadline
+extern double test_ns_per_address;
+extern __thread bool verbose;
+
+// Candidate addresses: one line per page of the pool at the victim's page offset, 
+// or one line per set index period with huge pages
+struct candidate_pool_t{
+  void *mapping;          // the mapping of the pool
+  uint64_t mapping_size;
+  void *base;             // the array within the mapping
+  uint64_t size;          // size of the array in bytes
+  uint64_t page_size;     // 4 KiB or HUGE_PAGE_SIZE
+  uint8_t *first;         // the first candidate
+  uint64_t stride;        // distance between two candidates in bytes
+  uint64_t count;         // number of candidates
+  #ifdef SPARSE_POOL
+  uint16_t *page_state;   // per page: number of non-colliding candidates, or PAGE_PINNED
+  uint64_t keep_first;    // candidates whose pages must stay mapped during the current scan
+  uint64_t keep_count;
+  uint64_t released_pages;
+  #endif // SPARSE_POOL
+};
+
+static inline void* get_candidate(struct candidate_pool_t* pool, uint64_t i){
+  return (void*) (pool->first + i*pool->stride);
+}
+
+// Candidate i of the list, or of the pool if there is no list
+static inline void* scan_candidate(struct candidate_pool_t* pool, void** list, uint64_t i){
+  return list ? list[i] : get_candidate(pool, i);
+}
+
+extern __thread uint64_t measurement_ctr;
+extern __thread uint64_t test_ctr;
+extern __thread uint64_t inconclusive_ctr;
+extern int group_size;
+
+// Batch mode (-v): one worker per physical core, each with its own slice of the candidate pool
+#define BATCH_MAX_THREADS 256
+
+// LLC map (-m): eviction sets for all line offsets of a page and all reachable sets and slices
+#define MAP_VICTIM_PAGES 512 // Scratch pages whose lines are the victims
+#define MAP_MAX_FAILURES 8 // Failed constructions in a row before the next offset
+#define MAP_COVERAGE_SAMPLES 256 // Pool candidates per offset to estimate the coverage
+#define MAP_MAX_SEEDS 256 // Colliding candidates of an earlier offset that are scanned before the pool
+
+struct llc_class_t{
+  int offset;
+  uint64_t *victim;
+  struct eviction_set_t ev_set; // Not allocated from the arena
+  struct eviction_set_t collisions; // Colliding candidates of the construction before the reduction, not from the arena
+};
+
+struct llc_map_t{
+  struct llc_class_t *class;
+  int classes;
+  int capacity;
+};
+
+// Partition (-p) of the candidate pool into congruence classes
+#define PARTITION_MAX_CLASSES 0xFFFD
+#define PARTITION_MAX_FAILURES 8 // Failed constructions in a row before the partition stops
+#define PARTITION_HIST_BINS 16
+#define PARTITION_LOOKUPS 1000
+#define PARTITION_UNASSIGNED 0
+#define PARTITION_UNASSIGNABLE 0xFFFF
+
+struct congruence_index_t{
+  struct candidate_pool_t pool;
+  uint16_t *class_of; // Per candidate: class + 1, PARTITION_UNASSIGNED or PARTITION_UNASSIGNABLE
+  struct eviction_set_t *sets; // Minimal eviction set per class, not allocated from the arena
+  uint64_t *class_size;
+  int classes;
+  int capacity;
+};
+
+struct worker_t{
+  pthread_t thread;
+  int cpu;
+  struct candidate_pool_t slice;
+  uint64_t **victims;
+  uint64_t victim_count;
+  uint64_t *next_victim; // Shared by all workers
+  int successes;
+  uint64_t measurements;
+};
+
+
+bool alloc_candidate_pool(struct candidate_pool_t* pool, uint64_t size);
+
+void free_candidate_pool(struct candidate_pool_t* pool);
+
+bool find_victim_set_offset(struct candidate_pool_t* pool, uint64_t* victim, uint64_t period, uint64_t* offset);
+
+void init_candidate_pool(struct candidate_pool_t* pool, uint64_t* victim);
+
+void prefault_candidate_pool(struct candidate_pool_t* pool);
+
+uint64_t get_page_faults();
+
+void print_memory_usage(struct candidate_pool_t* pool);
+
+void print_outlier_stats();
+
+void prefault_candidates(struct candidate_pool_t* pool, uint64_t first, uint64_t count);
 
-struct eviction_set_t* get_evset(uint64_t* addr_space, uint64_t* victim, uint64_t addr_space_size);
+void pin_candidate(struct candidate_pool_t* pool, void* candidate);
 
-void calibrate(uint64_t* target);
+void release_candidate(struct candidate_pool_t* pool, void* candidate);
+
+void release_kept_candidates(struct candidate_pool_t* pool);
+
+struct eviction_set_t* get_evset(struct candidate_pool_t* pool, uint64_t* victim, void** list, uint64_t first, uint64_t count);
+
+int classify_groups(uint64_t* victim, void** group_0, void** group_1, int k, double mean[2]);
+
+int classify_groups_fixed(uint64_t* victim, void** group_0, void** group_1, int k, double mean[2]);
+
+int classify_groups_sprt(uint64_t* victim, void** group_0, void** group_1, int k, double mean[2]);
+
+int classify_pair(uint64_t* victim, void* candidate_0, void* candidate_1, double mean[2]);
+
+void group_test(struct candidate_pool_t* pool, uint64_t* victim, void** candidates, void** controls, int k, struct eviction_set_t* ev_set, 
+        struct candidate_queue_t* requeue, int* success_ctr, int* failure_ctr);
+
+void* get_control_address(void* candidate);
+
+void bench_classification(struct candidate_pool_t* pool, uint64_t* victim);
+
+void calibrate(uint64_t* target, void* colliding);
+
+bool serialize_supported();
+
+int parse_serialization(const char* name);
+
+void bench_serialization(struct candidate_pool_t* pool, uint64_t* victim);
+
+write_kernel_t emit_kernel(uint8_t* code, struct kernel_config_t* config);
+
+void install_kernel(struct kernel_config_t* config);
+
+bool autotune_kernel(struct candidate_pool_t* pool, uint64_t* victim, int store);
+
+bool store_supported(int store);
+
+int parse_store(const char* name);
+
+void bench_stores(struct candidate_pool_t* pool, uint64_t* victim);
 
 // Functions to minimize and test the eviction set
 
-bool reduce_evset(uint64_t* victim, struct eviction_set_t** ev_set_ptr);
+bool reduce_evset(uint64_t* victim, struct eviction_set_t* ev_set, int reduced);
+
+void* arena_alloc(uint64_t size);
+
+void reset_evset_arena();
+
+void free_evset_arena();
+
+struct eviction_set_t* new_evset(int capacity);
 
 int get_evset_len(struct eviction_set_t* ev_set);
 
-void append_evset_address(struct eviction_set_t* ev_set, struct eviction_set_t* e);
+void append_evset_address(struct eviction_set_t* ev_set, uint64_t* address);
 
 void merge_evsets(struct eviction_set_t** a, struct eviction_set_t** b);
 
+uint64_t now_ns();
+
+bool deadline_passed();
+
+void calibrate_test_cost(uint64_t* victim);
+
+uint64_t estimate_reduction_ns(int len);
+
+bool scan_over_deadline(int found);
+
+double eviction_rate(uint64_t* victim, struct eviction_set_t* ev_set);
+
+void print_best_effort(uint64_t* victim, struct eviction_set_t* ev_set);
+
+struct eviction_set_t* build_evset(struct candidate_pool_t* pool, uint64_t* victim, bool* success);
+
+struct eviction_set_t* build_evset_from(struct candidate_pool_t* pool, uint64_t* victim, struct candidate_queue_t* seeds, 
+        bool scan_pool, struct eviction_set_t* collisions, bool* success);
+
+int get_physical_cores(int* cpus, int max);
+
+void* counting_thread(void* arg);
+
+bool start_counting_thread(bool shared);
+
+void select_timer(bool force_counter);
+
+void bench_timers(uint64_t* victim);
+
+void* evset_worker(void* arg);
+
+void run_batch(struct candidate_pool_t* pool, uint64_t victim_count, int max_threads);
+
+struct eviction_set_t* shift_evset(struct eviction_set_t* ev_set, int offset);
+
+void build_page_family(struct candidate_pool_t* pool, uint64_t* victim);
+
+void build_llc_map(struct candidate_pool_t* pool);
+
+void detect_llc();
+
+void partition_pool(struct candidate_pool_t* pool, struct congruence_index_t* index);
+
+int lookup_congruence_class(struct congruence_index_t* index, uint64_t* target);
+
+void run_partition(struct candidate_pool_t* pool);
+
+void link_evset(struct eviction_set_t* ev_set);
+
+int vote_evset(uint64_t *victim, struct eviction_set_t *ev_set);
+
 bool test_evset(uint64_t *victim, struct eviction_set_t *ev_set);
 
 // Output functions